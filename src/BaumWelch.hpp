@@ -0,0 +1,362 @@
+#ifndef PARATERBI__BAUMWELCH_HPP__
+#define PARATERBI__BAUMWELCH_HPP__
+
+#include "MatrixV.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <limits>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Unsupervised (EM) training of a Viterbi model on untagged sentences.
+//
+// The E-step runs the scaled forward/backward algorithm in probability space
+// over the same label vector layout the decoder uses: every column costs
+// labelCount SIMD multiply-adds per label vector, without any exp or log.
+// Sentences are spread over threads that each accumulate expected counts
+// in their own buffers; the M-step adds these up once per iteration. Emission
+// counts are the exception: a thread only keeps those of the words it met in
+// the current block and adds them to shared totals after every block, so
+// memory does not grow with threads times the vocabulary.
+template <typename viterbi_T>
+class BaumWelch {
+public:
+	using Viterbi_type = viterbi_T;
+	using Model_type = typename Viterbi_type::Model;
+	using Label_type = typename Viterbi_type::Label_type;
+	using Emission_type = typename Viterbi_type::Emission_type;
+	using Probability_type = typename Viterbi_type::Probability_type;
+	using floatv = typename Viterbi_type::floatv;
+	using Matrix_type = MatrixV<floatv>;
+	using Sentences_type = std::vector<std::vector<Emission_type>>;
+
+	struct Statistics {
+		// of the sentences under the model the iteration started with
+		double logLikelihood = 0.0;
+		size_t sentences = 0;
+		size_t words = 0;
+		// sentences the model gives probability 0, left out of the counts
+		size_t skipped = 0;
+	};
+
+public:
+	BaumWelch() = delete;
+	// smoothing mixes every distribution of the model with the uniform one
+	// before each iteration, so that zero probabilities of a supervised
+	// model do not rule out whole sentences forever
+	BaumWelch(short threads, Probability_type smoothing)
+		: m_threads(std::max<short>(1, threads)), m_smoothing(smoothing) {}
+
+	// one EM iteration: nextBlock(block) fills block with the next
+	// sentences and returns false once there are none left. Blocks are read
+	// on the calling thread while the other threads work on the previous one.
+	template <typename reader_T>
+	Model_type iterate(const Model_type& model, reader_T nextBlock,
+					   Statistics& statistics) {
+		const auto p = Parameters{model, m_smoothing};
+		auto accumulators = std::vector<Accumulator>{};
+		for (int t = 0; t < m_threads; ++t) {
+			accumulators.emplace_back(model.labelCount());
+		}
+		auto emissions =
+			Matrix_type{model.labelCount(), model.emissionCount(), 0};
+
+		auto block = Sentences_type{};
+		auto next = Sentences_type{};
+		auto more = nextBlock(block);
+		while (!block.empty()) {
+			auto sentence = std::atomic<size_t>{0};
+			const auto work = [&](int t) {
+				for (auto i = sentence.fetch_add(1); i < block.size();
+					 i = sentence.fetch_add(1)) {
+					expect(p, block[i], accumulators[t]);
+				}
+			};
+
+			auto workers = std::vector<std::thread>{};
+			for (int t = 1; t < m_threads; ++t) {
+				workers.emplace_back(work, t);
+			}
+			next.clear();
+			if (more) {
+				more = nextBlock(next);
+			}
+			work(0);
+			for (auto& w : workers) {
+				w.join();
+			}
+			for (auto& a : accumulators) {
+				collect(a, emissions);
+			}
+			std::swap(block, next);
+		}
+
+		statistics = Statistics{};
+		for (const auto& a : accumulators) {
+			statistics.logLikelihood += a.logLikelihood;
+			statistics.sentences += a.sentences;
+			statistics.words += a.words;
+			statistics.skipped += a.skipped;
+		}
+		return maximize(model, accumulators, emissions);
+	}
+
+private:
+	// the model in probability space
+	struct Parameters {
+		Parameters(const Model_type& m, Probability_type smoothing)
+			: labels(m.labelCount()),
+			  start(labels, 1, 0),
+			  transitions(labels, labels, 0),
+			  reverse(labels, labels, 0),
+			  emissions(labels, m.emissionCount(), 0) {
+			const auto mix = [smoothing](Probability_type logP, int n) {
+				return (1 - smoothing) * std::exp(logP) + smoothing / n;
+			};
+			const int emissionCount = m.emissionCount();
+			for (int i = 0; i < labels; ++i) {
+				start(i, 0) = mix(m.getStart(i), labels);
+				for (int k = 0; k < labels; ++k) {
+					transitions(i, k) = mix(m.getTransition(k, i), labels);
+					reverse(k, i) = transitions(i, k);
+				}
+				for (int e = 0; e < emissionCount; ++e) {
+					emissions(i, e) = mix(m.getEmission(i, e), emissionCount);
+				}
+			}
+		}
+
+		int labels;
+		Matrix_type start;
+		// (to, from) like the decoder's, vectors over the next label
+		Matrix_type transitions;
+		// (from, to), vectors over the previous label for the backward pass
+		Matrix_type reverse;
+		Matrix_type emissions;
+	};
+
+	// expected counts of one thread and its forward/backward scratch
+	struct Accumulator {
+		explicit Accumulator(int labels)
+			: start(labels, 1, 0),
+			  transitions(labels, labels, 0),
+			  emissions(labels, 0, 0),
+			  seen(),
+			  columns(),
+			  alpha(labels, 8, 0),
+			  beta(labels, 8, 0),
+			  weights(labels, 1, 0),
+			  scale() {}
+
+		// the column of emissions counting e, a zeroed one the first time
+		// e is seen in a block
+		int column(Emission_type e) {
+			const auto inserted = columns.emplace(e, seen.size());
+			if (inserted.second) {
+				seen.push_back(e);
+				emissions.reserve(seen.size());
+				const auto c = seen.size() - 1;
+				const auto vectors = emissions.vectorsCountPerColumn();
+				for (size_t v = 0; v < vectors; ++v) {
+					emissions.vector(v, c) = floatv(Probability_type{0});
+				}
+			}
+			return inserted.first->second;
+		}
+
+		Matrix_type start;
+		Matrix_type transitions;
+		// counts of the words seen in this block, column i for seen[i]
+		Matrix_type emissions;
+		std::vector<Emission_type> seen;
+		std::unordered_map<Emission_type, int> columns;
+		double logLikelihood = 0.0;
+		size_t sentences = 0;
+		size_t words = 0;
+		size_t skipped = 0;
+
+		Matrix_type alpha;
+		Matrix_type beta;
+		Matrix_type weights;
+		std::vector<Probability_type> scale;
+	};
+
+	// normalizes column j of alpha to sum 1, returns false if it is all 0
+	static bool normalize(const Parameters& p, Accumulator& a, int j) {
+		auto sum = Probability_type{0};
+		for (int i = 0; i < p.labels; ++i) {
+			sum += a.alpha(i, j);
+		}
+		if (!(sum > 0)) return false;
+
+		a.scale[j] = sum;
+		const auto inverse = floatv(1 / sum);
+		for (size_t v = 0; v < a.alpha.vectorsCountPerColumn(); ++v) {
+			a.alpha.vector(v, j) *= inverse;
+		}
+		return true;
+	}
+
+	// adds the expected counts of one sentence to a
+	static void expect(const Parameters& p, const std::vector<Emission_type>& ts,
+					   Accumulator& a) {
+		const int n = ts.size();
+		if (n == 0) return;
+		const int vectors = a.alpha.vectorsCountPerColumn();
+
+		a.alpha.reserve(n);
+		a.beta.reserve(n);
+		a.scale.resize(n);
+
+		// forward
+		for (int v = 0; v < vectors; ++v) {
+			a.alpha.vector(v, 0) =
+				p.start.vector(v, 0) * p.emissions.vector(v, ts[0]);
+		}
+		if (!normalize(p, a, 0)) {
+			++a.skipped;
+			return;
+		}
+		for (int j = 1; j < n; ++j) {
+			for (int v = 0; v < vectors; ++v) {
+				auto sum = floatv(Probability_type{0});
+				for (int k = 0; k < p.labels; ++k) {
+					sum += a.alpha(k, j - 1) * p.transitions.vector(v, k);
+				}
+				a.alpha.vector(v, j) = sum * p.emissions.vector(v, ts[j]);
+			}
+			if (!normalize(p, a, j)) {
+				++a.skipped;
+				return;
+			}
+		}
+
+		// backward, counting transitions into column j + 1 on the way
+		for (int v = 0; v < vectors; ++v) {
+			a.beta.vector(v, n - 1) = floatv(Probability_type{1});
+		}
+		for (int j = n - 2; j >= 0; --j) {
+			const auto inverse = floatv(1 / a.scale[j + 1]);
+			for (int v = 0; v < vectors; ++v) {
+				a.weights.vector(v, 0) = p.emissions.vector(v, ts[j + 1]) *
+										 a.beta.vector(v, j + 1) * inverse;
+			}
+			for (int k = 0; k < p.labels; ++k) {
+				const auto from = a.alpha(k, j);
+				for (int v = 0; v < vectors; ++v) {
+					a.transitions.vector(v, k) += from *
+												  p.transitions.vector(v, k) *
+												  a.weights.vector(v, 0);
+				}
+			}
+			for (int v = 0; v < vectors; ++v) {
+				auto sum = floatv(Probability_type{0});
+				for (int i = 0; i < p.labels; ++i) {
+					sum += a.weights(i, 0) * p.reverse.vector(v, i);
+				}
+				a.beta.vector(v, j) = sum;
+			}
+		}
+
+		// label posteriors are alpha * beta with this scaling
+		for (int v = 0; v < vectors; ++v) {
+			a.start.vector(v, 0) += a.alpha.vector(v, 0) * a.beta.vector(v, 0);
+		}
+		for (int j = 0; j < n; ++j) {
+			const auto c = a.column(ts[j]);
+			for (int v = 0; v < vectors; ++v) {
+				a.emissions.vector(v, c) +=
+					a.alpha.vector(v, j) * a.beta.vector(v, j);
+			}
+			a.logLikelihood += std::log(a.scale[j]);
+		}
+		++a.sentences;
+		a.words += n;
+	}
+
+	// adds the emission counts of a's block to emissions and forgets them
+	static void collect(Accumulator& a, Matrix_type& emissions) {
+		for (size_t c = 0; c < a.seen.size(); ++c) {
+			for (size_t v = 0; v < emissions.vectorsCountPerColumn(); ++v) {
+				emissions.vector(v, a.seen[c]) += a.emissions.vector(v, c);
+			}
+		}
+		a.seen.clear();
+		a.columns.clear();
+	}
+
+	// sums the counts of all threads and estimates the next model; rows
+	// without any count keep their previous values
+	static Model_type maximize(const Model_type& model,
+							   std::vector<Accumulator>& accumulators,
+							   const Matrix_type& emissionCounts) {
+		auto& sum = accumulators.front();
+		for (size_t t = 1; t < accumulators.size(); ++t) {
+			add(sum.start, accumulators[t].start);
+			add(sum.transitions, accumulators[t].transitions);
+		}
+
+		const int labels = model.labelCount();
+		const int emissions = model.emissionCount();
+		auto m = model;
+
+		const auto normalizer = [labels](const Matrix_type& counts) {
+			auto total = Probability_type{0};
+			for (int i = 0; i < labels; ++i) {
+				total += counts(i, 0);
+			}
+			return total;
+		};
+		const auto logRatio = [](Probability_type count,
+								 Probability_type total) {
+			return count > 0 ? std::log(count / total)
+							 : -std::numeric_limits<Probability_type>::infinity();
+		};
+
+		const auto starts = normalizer(sum.start);
+		if (starts > 0) {
+			for (int i = 0; i < labels; ++i) {
+				m.setStart(i, logRatio(sum.start(i, 0), starts));
+			}
+		}
+		for (int from = 0; from < labels; ++from) {
+			auto total = Probability_type{0};
+			for (int to = 0; to < labels; ++to) {
+				total += sum.transitions(to, from);
+			}
+			if (!(total > 0)) continue;
+			for (int to = 0; to < labels; ++to) {
+				m.setTransition(from, to,
+								logRatio(sum.transitions(to, from), total));
+			}
+		}
+		for (int l = 0; l < labels; ++l) {
+			auto total = Probability_type{0};
+			for (int e = 0; e < emissions; ++e) {
+				total += emissionCounts(l, e);
+			}
+			if (!(total > 0)) continue;
+			for (int e = 0; e < emissions; ++e) {
+				m.setEmission(l, e, logRatio(emissionCounts(l, e), total));
+			}
+		}
+		return m;
+	}
+
+	static void add(Matrix_type& sum, const Matrix_type& other) {
+		for (size_t j = 0; j < sum.columns(); ++j) {
+			for (size_t v = 0; v < sum.vectorsCountPerColumn(); ++v) {
+				sum.vector(v, j) += other.vector(v, j);
+			}
+		}
+	}
+
+private:
+	const short m_threads;
+	const Probability_type m_smoothing;
+};  // end class BaumWelch
+
+#endif
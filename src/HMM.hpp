@@ -3,38 +3,172 @@
 #ifndef __HMM_HPP__
 #define __HMM_HPP__
 
+#include "ResultCache.hpp"
 #include "utility.hpp"
+#include <chrono>
 #include <iostream>
 #include <string>
 #include <unordered_map>
 #include <vector>
 #include <fstream>
-#include <boost/functional/hash.hpp>
+#include <numeric>
+#include <memory>
+#include <iomanip>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+#include <type_traits>
 #include <boost/bimap.hpp>
 #include <math.h>
+#include <stdlib.h>
 
 
-	auto total = std::chrono::duration<double, std::milli>{0};
+	inline auto total = std::chrono::duration<double, std::milli>{0};
 
+// models of second-order decoders (TrigramViterbi) have trigram probabilities
+template <typename model_T, typename = void>
+struct isSecondOrder : std::false_type {};
+
+template <typename model_T>
+struct isSecondOrder<model_T,
+					 std::void_t<decltype(&model_T::setTrigram)>>
+	: std::true_type {};
+
+// models that may be restricted to a band of transitions (Viterbi::Band)
+template <typename model_T, typename = void>
+struct isBandable : std::false_type {};
+
+template <typename model_T>
+struct isBandable<model_T, std::void_t<decltype(&model_T::getBand)>>
+	: std::true_type {};
 
 template <typename viterbi_T>
 class HMM {
 public:
 	using Viterbi_type = viterbi_T;
 	using Model_type = typename Viterbi_type::Model;
+	using Label_type = typename Viterbi_type::Label_type;
+	using Emission_type = typename Viterbi_type::Emission_type;
+	using Cache_type = ResultCache<Emission_type, Label_type>;
 
 public:
 	HMM() = delete;
-	HMM(const std::string& filename) : m_viterbi(mlTrain(filename)) {}
-
+	// any further arguments are passed on to the decoder
+	template <typename... decoderArgs_T>
+	HMM(const std::string& filename, decoderArgs_T&&... decoderArgs)
+		: HMM(std::make_shared<Shared>(), filename,
+			  std::forward<decoderArgs_T>(decoderArgs)...) {}
+
+	// loads a model written by save instead of training one
+	template <typename... decoderArgs_T>
+	HMM(std::istream& saved, decoderArgs_T&&... decoderArgs)
+		: HMM(std::make_shared<Shared>(), saved,
+			  std::forward<decoderArgs_T>(decoderArgs)...) {}
+
+	// copies share the vocabulary, the counts and the trained model (updates
+	// reach all of them), each copy only owns its own decoding state
 	HMM(const HMM& other) = default;
 	HMM& operator=(const HMM& rhs) = default;
 	std::vector<std::string> infer(const std::vector<std::string>& ws) {
-		auto is =
-			std::vector<typename Viterbi_type::Emission_type>(ws.size(), 0);
+		const auto is = toEmissions(ws);
+
+		auto before = std::chrono::high_resolution_clock::now();
+
+		const auto c = cache();
+		const auto generation = c ? c->generation() : 0;
+		const auto key = c ? Cache_type::key(is) : typename Cache_type::Key{};
+		auto iouts = std::vector<Label_type>{};
+		if (!c || !c->find(key, iouts)) {
+			iouts = m_viterbi.infer(is);
+			if (c) c->insert(key, iouts, generation);
+		}
+
+		total += std::chrono::high_resolution_clock::now() - before;
+
+		return toLabels(iouts);
+	}  // end infer
+
+	std::vector<std::vector<std::string>> inferBatch(
+		const std::vector<std::vector<std::string>>& batch) {
+		auto is = std::vector<std::vector<Emission_type>>(batch.size());
+		std::transform(batch.cbegin(), batch.cend(), is.begin(),
+					   [this](const std::vector<std::string>& ws) {
+						   return toEmissions(ws);
+					   });
+
+		const auto iouts = inferBatch(is);
+
+		auto outs = std::vector<std::vector<std::string>>(batch.size());
+		std::transform(iouts.cbegin(), iouts.cend(), outs.begin(),
+					   [this](const std::vector<Label_type>& ls) {
+						   return toLabels(ls);
+					   });
+		return outs;
+	}
+
+	// decodes sentences already mapped by toEmissions, labels are left as ids
+	// for toLabels; lets callers run the lookups on other threads
+	std::vector<std::vector<Label_type>> inferBatch(
+		const std::vector<std::vector<Emission_type>>& batch) {
+		auto before = std::chrono::high_resolution_clock::now();
+
+		const auto c = cache();
+		if (!c) {
+			auto iouts = m_viterbi.inferBatch(batch);
+			total += std::chrono::high_resolution_clock::now() - before;
+			return iouts;
+		}
 
+		// only the sentences the cache misses reach the decoder
+		const auto generation = c->generation();
+		auto iouts = std::vector<std::vector<Label_type>>(batch.size());
+		auto keys = std::vector<typename Cache_type::Key>(batch.size());
+		auto missed = std::vector<size_t>{};
+		auto misses = std::vector<std::vector<Emission_type>>{};
+		for (size_t i = 0; i < batch.size(); ++i) {
+			keys[i] = Cache_type::key(batch[i]);
+			if (!c->find(keys[i], iouts[i])) {
+				missed.push_back(i);
+				misses.push_back(batch[i]);
+			}
+		}
+		if (!misses.empty()) {
+			auto decoded = m_viterbi.inferBatch(misses);
+			for (size_t m = 0; m < missed.size(); ++m) {
+				c->insert(keys[missed[m]], decoded[m], generation);
+				iouts[missed[m]] = std::move(decoded[m]);
+			}
+		}
+
+		total += std::chrono::high_resolution_clock::now() - before;
+
+		return iouts;
+	}
+
+	// caches decoded sentences in at most budget bytes, shared by all copies
+	// of this HMM and emptied by every update; 0 turns the cache off. Set it
+	// before decoding starts.
+	void setCacheBudget(size_t budget) {
+		std::atomic_store(&m_shared->cache,
+						  budget == 0 ? std::shared_ptr<Cache_type>{}
+									  : std::make_shared<Cache_type>(budget));
+	}
+
+	// all zero without a cache
+	typename Cache_type::Statistics cacheStatistics() const {
+		const auto c = cache();
+		return c ? c->statistics() : typename Cache_type::Statistics{};
+	}
+
+	// words the training corpus never saw map to emission 0
+	std::vector<Emission_type> toEmissions(
+		const std::vector<std::string>& ws) const {
+		auto is = std::vector<Emission_type>(ws.size(), 0);
+
+		const auto v = vocabulary();
+		const auto& emissionBijection = v->emissions;
 		std::transform(ws.cbegin(), ws.cend(), is.begin(),
-					   [this](const std::string& w) {
+					   [&emissionBijection](const std::string& w) {
 						   auto i = emissionBijection.left.find(w);
 						   if (i == emissionBijection.left.end()) {
 							   std::cerr << w << " not covered.\n";
@@ -42,144 +176,483 @@ public:
 						   }
 						   return i->second;
 					   });
+		return is;
+	}
 
-		auto before = std::chrono::high_resolution_clock::now();
+	inline typename Viterbi_type::ModelPtr model() const {
+		return m_viterbi.model();
+	}
 
-		auto iouts = m_viterbi.infer(is);
+	// decoders built on the slot follow every update
+	inline const auto& modelSlot() const {
+		return m_viterbi.slot();
+	}
 
-		total += std::chrono::high_resolution_clock::now() - before;
+	// for decoder settings beyond the constructor's
+	inline Viterbi_type& decoder() { return m_viterbi; }
 
-		auto outs = std::vector<std::string>(ws.size(), "");
+	inline int labelCount() const { return vocabulary()->labels.size(); }
+	inline int emissionCount() const { return vocabulary()->emissions.size(); }
 
-		std::transform(iouts.cbegin(), iouts.cend(), outs.begin(),
-					   [this](const typename Viterbi_type::Label_type& l) {
+	// -1 for words the training corpus never saw
+	Emission_type emissionId(const std::string& w) const {
+		const auto v = vocabulary();
+		const auto i = v->emissions.left.find(w);
+		return i == v->emissions.left.end() ? -1 : i->second;
+	}
+
+	// valid until the next update
+	const std::string& labelName(Label_type l) const {
+		return vocabulary()->labels.right.find(l)->second;
+	}
+
+	// writes "id\tword" and "id\tlabel" lines by id, all of one vocabulary,
+	// for clients that map words to ids themselves (Format::Binary)
+	void exportIds(std::ostream& words, std::ostream& labels) const {
+		const auto v = vocabulary();
+		for (int e = 0; e < static_cast<int>(v->emissions.size()); ++e) {
+			words << e << "\t" << v->emissions.right.find(e)->second << "\n";
+		}
+		for (int l = 0; l < static_cast<int>(v->labels.size()); ++l) {
+			labels << l << "\t" << v->labels.right.find(l)->second << "\n";
+		}
+	}
+
+	// counts further tagged sentences (corpus format) on top of everything
+	// trained so far and publishes the re-estimated model to all decoders
+	// sharing this HMM's model slot, which keep decoding meanwhile. Unless
+	// new labels or words grow the model, only the rows of the labels in the
+	// new sentences are estimated again.
+	void update(std::istream& sentences) {
+		auto lock = std::lock_guard<std::mutex>{m_shared->updating};
+		if (!m_shared->counted) {
+			throw std::logic_error{
+				"only models trained from a corpus keep counts to update"};
+		}
+		auto& counts = m_shared->counts;
+		auto v = std::make_shared<Vocabulary>(*vocabulary());
+		const auto rows = count(sentences, *v, counts);
+
+		const auto current = model();
+		const int labels = v->labels.size();
+		const int emissions = v->emissions.size();
+		if (labels == current->labelCount() &&
+			emissions == current->emissionCount()) {
+			auto m = Model_type{*current};
+			estimate(counts, rows, m);
+			publish(std::move(v), std::move(m));
+		} else {
+			auto m = emptyLike(*current, labels, emissions);
+			estimate(counts, allLabels(labels), m);
+			publish(std::move(v), std::move(m));
+		}
+	}
+
+	void update(const std::string& filename) {
+		auto file = std::ifstream{filename};
+		update(file);
+	}
+
+	// publishes a model estimated elsewhere (e.g. by BaumWelch) for the same
+	// labels and words. Later updates still count on top of the corpus.
+	void setModel(Model_type m) {
+		auto lock = std::lock_guard<std::mutex>{m_shared->updating};
+		if (m.labelCount() != labelCount() ||
+			m.emissionCount() != emissionCount()) {
+			throw std::invalid_argument{
+				"model does not match the vocabulary"};
+		}
+		m_viterbi.publish(std::make_shared<const Model_type>(std::move(m)));
+		forget();
+	}
+
+	// writes vocabulary and log probabilities as text:
+	//   paraterbi-model 1
+	//   <labels> <emissions>
+	//   one label name per line, then one word per line, by id
+	//   start probabilities, then one line of transitions per previous
+	//   label and one line of emissions per label
+	// Second-order models are not saved, train them from a corpus.
+	void save(std::ostream& out) const {
+		if constexpr (isSecondOrder<Model_type>::value) {
+			throw std::logic_error{"second-order models cannot be saved"};
+		}
+		const auto v = vocabulary();
+		const auto m = model();
+		const int labels = m->labelCount();
+		const int emissions = m->emissionCount();
+
+		out << "paraterbi-model 1\n" << labels << " " << emissions << "\n";
+		for (int l = 0; l < labels; ++l) {
+			out << v->labels.right.find(l)->second << "\n";
+		}
+		for (int e = 0; e < emissions; ++e) {
+			out << v->emissions.right.find(e)->second << "\n";
+		}
+
+		out << std::setprecision(std::numeric_limits<double>::max_digits10);
+		const auto row = [&out](int n, auto value) {
+			for (int i = 0; i < n; ++i) {
+				out << (i == 0 ? "" : " ") << value(i);
+			}
+			out << "\n";
+		};
+		row(labels, [&m](int l) { return m->getStart(l); });
+		for (int from = 0; from < labels; ++from) {
+			row(labels,
+				[&m, from](int to) { return m->getTransition(from, to); });
+		}
+		for (int l = 0; l < labels; ++l) {
+			row(emissions, [&m, l](int e) { return m->getEmission(l, e); });
+		}
+	}
+
+	std::vector<std::string> toLabels(const std::vector<Label_type>& ls) const {
+		auto outs = std::vector<std::string>(ls.size(), "");
+
+		const auto v = vocabulary();
+		const auto& labelBijection = v->labels;
+		std::transform(ls.cbegin(), ls.cend(), outs.begin(),
+					   [&labelBijection](const Label_type& l) {
 						   return labelBijection.right.find(l)->second;
 					   });
-
 		return outs;
-	}  // end infer
+	}
 
 private:
-	using stringmap = std::unordered_map<std::string, int>;
-	using stringpair = std::pair<std::string, std::string>;
-	using pairmap =
-		std::unordered_map<stringpair, int, boost::hash<stringpair>>;
 	using bijection = boost::bimap<std::string, int>;
 	using bijectionPair = bijection::value_type;
 
+	struct Vocabulary {
+		bijection labels;
+		bijection emissions;
+	};
+
+	// everything training has counted so far, indexed by label id
+	struct Counts {
+		long sentences = 0;
+		std::vector<long> starts;
+		std::vector<long> labels;
+		// by previous label
+		std::vector<std::unordered_map<Label_type, long>> transitions;
+		std::vector<std::unordered_map<Emission_type, long>> emissions;
+		// by the two previous labels, pair(first, second)
+		std::unordered_map<uint64_t, std::unordered_map<Label_type, long>>
+			trigrams;
+
+		static inline uint64_t pair(Label_type first, Label_type second) {
+			return static_cast<uint64_t>(first) << 32 |
+				   static_cast<uint32_t>(second);
+		}
+	};
+
+	// what all copies of an HMM share
+	struct Shared {
+		std::mutex updating;
+		// false for models loaded from a file
+		bool counted = false;
+		Counts counts;
+		// replaced as a whole by updates, only accessed through
+		// std::atomic_load/std::atomic_store
+		std::shared_ptr<const Vocabulary> vocabulary;
+		// null unless enabled, accessed like vocabulary
+		std::shared_ptr<Cache_type> cache;
+	};
+
 private:
-	Model_type mlTrain(const std::string& filename) {
+	template <typename... decoderArgs_T>
+	HMM(std::shared_ptr<Shared> shared, const std::string& filename,
+		decoderArgs_T&&... decoderArgs)
+		: m_shared(shared),
+		  m_viterbi(mlTrain(filename, *shared),
+					std::forward<decoderArgs_T>(decoderArgs)...) {}
+
+	template <typename... decoderArgs_T>
+	HMM(std::shared_ptr<Shared> shared, std::istream& saved,
+		decoderArgs_T&&... decoderArgs)
+		: m_shared(shared),
+		  m_viterbi(load(saved, *shared),
+					std::forward<decoderArgs_T>(decoderArgs)...) {}
+
+	inline std::shared_ptr<const Vocabulary> vocabulary() const {
+		return std::atomic_load(&m_shared->vocabulary);
+	}
+
+	inline std::shared_ptr<Cache_type> cache() const {
+		return std::atomic_load(&m_shared->cache);
+	}
+
+	// after publishing a model: what the old one decoded is stale
+	void forget() {
+		if (const auto c = cache()) c->clear();
+	}
+
+	Model_type mlTrain(const std::string& filename, Shared& shared) {
 		auto file = std::ifstream{filename};
+		auto v = std::make_shared<Vocabulary>();
+		count(file, *v, shared.counts);
+
+		const int labels = v->labels.size();
+		auto m = Model_type{labels, static_cast<int>(v->emissions.size()),
+							std::log(0.0f)};
+		estimate(shared.counts, allLabels(labels), m);
+		shared.vocabulary = std::move(v);
+		shared.counted = true;
+		return m;
+	}
+
+	// reads what save wrote
+	static Model_type load(std::istream& in, Shared& shared) {
+		const auto fail = []() {
+			return std::runtime_error{"not a paraterbi model file"};
+		};
+		if constexpr (isSecondOrder<Model_type>::value) {
+			throw std::logic_error{"second-order models cannot be loaded"};
+		}
+		auto line = std::string{};
+		int labels = 0;
+		int emissions = 0;
+		if (!std::getline(in, line) || line != "paraterbi-model 1" ||
+			!(in >> labels >> emissions) || labels < 0 || emissions < 0 ||
+			!std::getline(in, line)) {
+			throw fail();
+		}
+
+		auto v = std::make_shared<Vocabulary>();
+		for (int l = 0; l < labels && std::getline(in, line); ++l) {
+			v->labels.insert(bijectionPair(line, l));
+		}
+		for (int e = 0; e < emissions && std::getline(in, line); ++e) {
+			v->emissions.insert(bijectionPair(line, e));
+		}
+		if (static_cast<int>(v->labels.size()) != labels ||
+			static_cast<int>(v->emissions.size()) != emissions) {
+			throw fail();
+		}
+
+		// operator>> does not read "-inf"
+		const auto value = [&in, &fail]() {
+			auto token = std::string{};
+			if (!(in >> token)) throw fail();
+			return std::strtod(token.c_str(), nullptr);
+		};
+		auto m = Model_type{labels, emissions, std::log(0.0f)};
+		for (int l = 0; l < labels; ++l) {
+			m.setStart(l, value());
+		}
+		for (int from = 0; from < labels; ++from) {
+			for (int to = 0; to < labels; ++to) {
+				m.setTransition(from, to, value());
+			}
+		}
+		for (int l = 0; l < labels; ++l) {
+			for (int e = 0; e < emissions; ++e) {
+				m.setEmission(l, e, value());
+			}
+		}
+
+		shared.vocabulary = std::move(v);
+		return m;
+	}
 
+	// counts the tagged sentences read from in, adding unseen labels and
+	// words to the vocabulary; returns the labels whose rows changed
+	static std::vector<Label_type> count(std::istream& in,
+										 Vocabulary& vocabulary,
+										 Counts& counts) {
+		const auto idOf = [](bijection& b, const std::string& name) {
+			const auto i = b.left.find(name);
+			if (i != b.left.end()) return i->second;
+			const int id = b.size();
+			b.insert(bijectionPair(name, id));
+			return id;
+		};
+
+		auto seen = std::vector<bool>(counts.labels.size(), false);
 		bool isNewSent = true;
-		stringmap initialLabelCount;
-		stringmap labelCount;
-		pairmap transitionCount;
-		pairmap emissionCount;
-		std::string prevLabel;
-		int nextLabel = 0;
-		int nextEmission = 0;
-		int numSents = 0;
+		Label_type prevLabel = 0;
+		// label before prevLabel, -1 at the second word of a sentence
+		Label_type prevPrevLabel = -1;
 
 		for (std::string label, emission = "";
-			 std::getline(file, emission) && std::getline(file, label);) {
+			 std::getline(in, emission) && std::getline(in, label);) {
 			// if its two new lines in the file emission will be empty
-			// note: we require two newlines at end of file (or numSents is
-			// wrong)
+			// note: we require two newlines at end of file (or the sentence
+			// count is wrong)
 			if (emission == "") {
 				isNewSent = true;
-				numSents += 1;
+				counts.sentences += 1;
 				emission = label;
-				if (!std::getline(file, label)) break;
-//			} else {
+				if (!std::getline(in, label)) break;
 			}
 
-				// bijections
-				if (labelBijection.left.find(label) ==
-					labelBijection.left.end()) {
-					labelBijection.insert(bijectionPair(label, nextLabel++));
-				}
-
-				if (emissionBijection.left.find(emission) ==
-					emissionBijection.left.end()) {
-					emissionBijection.insert(
-						bijectionPair(emission, nextEmission++));
-				}
+			const auto l = idOf(vocabulary.labels, label);
+			const auto e = idOf(vocabulary.emissions, emission);
+			if (l >= static_cast<Label_type>(counts.labels.size())) {
+				counts.starts.resize(l + 1, 0);
+				counts.labels.resize(l + 1, 0);
+				counts.transitions.resize(l + 1);
+				counts.emissions.resize(l + 1);
+				seen.resize(l + 1, false);
+			}
 
-				if (isNewSent) {
-					isNewSent = false;
-					initialLabelCount[label] += 1;
-					labelCount[label] += 1;
-					prevLabel = label;
-				} else {
-					// it is not a new sentence, so prevLabel is valid
-					transitionCount[std::make_pair(prevLabel, label)] += 1;
-					labelCount[label] += 1;
+			if (isNewSent) {
+				isNewSent = false;
+				counts.starts[l] += 1;
+				prevPrevLabel = -1;
+			} else {
+				// it is not a new sentence, so prevLabel is valid
+				counts.transitions[prevLabel][l] += 1;
+				if (prevPrevLabel >= 0) {
+					counts.trigrams[Counts::pair(prevPrevLabel, prevLabel)]
+								   [l] += 1;
 				}
-
-				// we can always count emissions
-				emissionCount[std::make_pair(label, emission)] += 1;
-				prevLabel = label;
+				prevPrevLabel = prevLabel;
+			}
+			counts.labels[l] += 1;
+			// we can always count emissions
+			counts.emissions[l][e] += 1;
+			seen[l] = true;
+			prevLabel = l;
 		}  // end for
 
-		// now comes the ml-estimate step
-		auto maxLabel = nextLabel;
-		auto maxEmission = nextEmission;
-/*		std::cout << "Labels: " << maxLabel << "\nEmissions: " << maxEmission
-				  << "\nSentences: " << numSents << std::endl;
-*/
-		auto m = Model_type{maxLabel, maxEmission, std::log(0.0f)};
-
-/*		for (auto i = 0; i < maxLabel; ++i) {
-			m.start[i] =
-				log(initialLabelCount[labelBijection.right.find(i)->second]) -
-				log(numSents);
+		auto rows = std::vector<Label_type>{};
+		for (Label_type l = 0; l < static_cast<Label_type>(seen.size()); ++l) {
+			if (seen[l]) rows.push_back(l);
 		}
-*/
+		return rows;
+	}
 
-		for(const auto& l : initialLabelCount) {
-			m.setStart(labelBijection.left.find(l.first)->second, log(l.second) - log(numSents));
+	// maximum likelihood estimates of all start probabilities and of the
+	// transitions from and emissions of the given labels
+	static void estimate(const Counts& counts, const std::vector<Label_type>& rows,
+						 Model_type& m) {
+		for (Label_type l = 0; l < static_cast<Label_type>(counts.starts.size());
+			 ++l) {
+			if (counts.starts[l] > 0) {
+				m.setStart(l, log(counts.starts[l]) - log(counts.sentences));
+			}
 		}
 
+		for (const auto l : rows) {
+			const auto total = log(counts.labels[l]);
+			for (const auto& t : counts.transitions[l]) {
+				m.setTransition(l, t.first, log(t.second) - total);
+			}
+			for (const auto& e : counts.emissions[l]) {
+				m.setEmission(l, e.first, log(e.second) - total);
+			}
+		}
 
-		// transitions
-		for(const auto& t : transitionCount) {
-			auto i = labelBijection.left.find(t.first.first)->second;
-			auto j = labelBijection.left.find(t.first.second)->second;
-			m.setTransition(i, j, log(t.second) - log(labelCount[t.first.first]));
+		if constexpr (isSecondOrder<Model_type>::value) {
+			estimateTrigrams(counts, m);
 		}
+	}
 
-/*
-		for (auto i = 0; i < maxLabel; ++i) {
-			for (auto j = 0; j < maxLabel; ++j) {
-				m.setTransition(i, j, 
-					log(transitionCount[std::make_pair(
-						labelBijection.right.find(i)->second,
-						labelBijection.right.find(j)->second)]) -
-					log(labelCount[labelBijection.right.find(i)->second]));
+	// all trigram probabilities, as maximum likelihood trigram, bigram and
+	// unigram estimates interpolated with weights found by deleted
+	// interpolation (Brants, TnT, 2000): every trigram votes, with its
+	// count, for the estimate that predicts it best with itself left out.
+	// The unigram weight is kept at MinUnigramWeight at least, so that
+	// unseen trigrams of labels in the corpus keep a nonzero probability
+	// even when no trigram voted for it.
+	static void estimateTrigrams(const Counts& counts, Model_type& m) {
+		static const double MinUnigramWeight = 1e-3;
+		const int labels = counts.labels.size();
+		const auto tokens = static_cast<double>(
+			std::accumulate(counts.labels.cbegin(), counts.labels.cend(), 0L));
+		const auto bigram = [&counts](Label_type from, Label_type to) {
+			const auto i = counts.transitions[from].find(to);
+			return i == counts.transitions[from].end() ? 0L : i->second;
+		};
+		const auto ratio = [](double count, double total) {
+			return total > 0 ? count / total : 0.0;
+		};
+
+		double weights[3] = {0, 0, 0};
+		for (const auto& h : counts.trigrams) {
+			const Label_type first = h.first >> 32;
+			const Label_type second = h.first & 0xffffffff;
+			const auto history = bigram(first, second);
+			for (const auto& t : h.second) {
+				const auto unigram =
+					ratio(counts.labels[t.first] - 1, tokens - 1);
+				const auto bi = ratio(bigram(second, t.first) - 1,
+									  counts.labels[second] - 1);
+				const auto tri = ratio(t.second - 1, history - 1);
+				// ties go to the higher order
+				if (tri >= bi && tri >= unigram) {
+					weights[2] += t.second;
+				} else if (bi >= unigram) {
+					weights[1] += t.second;
+				} else {
+					weights[0] += t.second;
+				}
 			}
 		}
-*/
-		// emissions
-/*
-		for(auto i = 0; i < maxLabel; ++i) {
-		for(auto j = 0; j < nextEmission-1; ++j) {
-			m.emissions(i, j) = log(emissionCount[std::make_pair(labelBijection.right.find(i)->second, emissionBijection.right.find(j)->second)]) - log(labelCount[labelBijection.right.find(i)->second]);
+		const auto sum = weights[0] + weights[1] + weights[2];
+		if (sum == 0) {
+			weights[0] = 1;
+		} else {
+			for (auto& w : weights) w /= sum;
 		}
+		if (weights[0] < MinUnigramWeight) {
+			const auto rest = (1 - MinUnigramWeight) / (1 - weights[0]);
+			weights[0] = MinUnigramWeight;
+			weights[1] *= rest;
+			weights[2] *= rest;
 		}
-*/
-		for ( auto e = emissionCount.begin(); e != emissionCount.end(); ++e) {
-			m.setEmission(labelBijection.left.find(e->first.first)->second,
-						emissionBijection.left.find(e->first.second)->second,
-						log(e->second) - log(labelCount[e->first.first]));
+
+		for (Label_type first = 0; first < labels; ++first) {
+			for (Label_type second = 0; second < labels; ++second) {
+				const auto history = bigram(first, second);
+				const auto h = counts.trigrams.find(Counts::pair(first, second));
+				for (Label_type to = 0; to < labels; ++to) {
+					auto p = weights[0] * ratio(counts.labels[to], tokens) +
+							 weights[1] * ratio(bigram(second, to),
+												counts.labels[second]);
+					if (h != counts.trigrams.end()) {
+						const auto t = h->second.find(to);
+						if (t != h->second.end()) {
+							p += weights[2] * ratio(t->second, history);
+						}
+					}
+					m.setTrigram(first, second, to, log(p));
+				}
+			}
 		}
+	}
+
+	// a model of the given size with nothing possible yet, banded like
+	// current if that is
+	static Model_type emptyLike(const Model_type& current, int labels,
+								int emissions) {
+		if constexpr (isBandable<Model_type>::value) {
+			if (current.banded()) {
+				return Model_type{labels, emissions, std::log(0.0f),
+								  current.getBand()};
+			}
+		}
+		return Model_type{labels, emissions, std::log(0.0f)};
+	}
+
+	static std::vector<Label_type> allLabels(int labels) {
+		auto rows = std::vector<Label_type>(labels);
+		std::iota(rows.begin(), rows.end(), 0);
+		return rows;
+	}
 
-		return std::move(m);
+	// vocabulary first: ids are only ever appended and the decoder reads the
+	// words its model does not know yet as unknown ones, whereas a model
+	// ahead of the vocabulary could return labels without a name
+	void publish(std::shared_ptr<const Vocabulary> v, Model_type&& m) {
+		std::atomic_store(&m_shared->vocabulary, std::move(v));
+		m_viterbi.publish(std::make_shared<const Model_type>(std::move(m)));
+		forget();
 	}
 
 private:
-	bijection labelBijection;
-	bijection emissionBijection;
+	std::shared_ptr<Shared> m_shared;
 	Viterbi_type m_viterbi;
 };  // end class HMM
 
@@ -3,115 +3,271 @@
 #ifndef __MATRIXV_HPP__
 #define __MATRIXV_HPP__
 
+#include <sys/mman.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <memory>
-#include <vector>
+#include <new>
+#include <type_traits>
+#include <utility>
 
 #include <Vc/Vc>
 
+// Memory of a MatrixV: one allocation aligned to a cache line, and to a huge
+// page once it spans one, so that the kernel can back it with transparent
+// huge pages. Built with -DVITERBI_HUGE_PAGES (cmake -DHUGE_PAGES=ON), slabs
+// of at least one huge page are taken from the explicitly reserved ones
+// (/proc/sys/vm/nr_hugepages) first.
+class Slab {
+public:
+	static constexpr size_t CacheLine = 64;
+	static constexpr size_t HugePage = size_t{2} << 20;
+
+	struct Deleter {
+		void operator()(void* p) const {
+			if (mapped) {
+				::munmap(p, bytes);
+			} else {
+				std::free(p);
+			}
+		}
+
+		size_t bytes;
+		// by mmap instead of malloc
+		bool mapped;
+	};
+
+	using pointer_type = std::unique_ptr<void, Deleter>;
+
+	// uninitialized
+	static pointer_type allocate(size_t bytes) {
+		bytes = roundUp(std::max<size_t>(bytes, 1), CacheLine);
+#if defined(VITERBI_HUGE_PAGES) && defined(MAP_HUGETLB)
+		if (bytes >= HugePage) {
+			const auto huge = roundUp(bytes, HugePage);
+			auto p = ::mmap(nullptr, huge, PROT_READ | PROT_WRITE,
+							MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+			if (p != MAP_FAILED) {
+				return pointer_type{p, Deleter{huge, true}};
+			}
+		}
+#endif
+		const auto alignment = bytes >= HugePage ? HugePage : CacheLine;
+		auto p = static_cast<void*>(nullptr);
+		if (::posix_memalign(&p, alignment, bytes) != 0) {
+			throw std::bad_alloc{};
+		}
+#ifdef MADV_HUGEPAGE
+		if (alignment == HugePage) {
+			// only advice, fine to fail
+			::madvise(p, bytes, MADV_HUGEPAGE);
+		}
+#endif
+		return pointer_type{p, Deleter{bytes, false}};
+	}
+
+	static size_t roundUp(size_t n, size_t multiple) {
+		return (n + multiple - 1) / multiple * multiple;
+	}
+};  // end class Slab
+
+// Column-major matrix of SIMD vectors: every column holds rows values padded
+// to whole vectors, so that vector(i, j) covers rows [i * Size, (i + 1) * Size)
+// of column j. All columns live in a single Slab, each starting on a cache
+// line, which keeps the emission matrix of a large vocabulary in one piece.
 template<typename vector_T>
 class MatrixV {
 public:
 //	using floatv = Vc::Vector<value_type>;
 	using floatv = vector_T;
 	using value_type = typename floatv::value_type;
-	//	using array_type = std::vector<floatv, Vc::allocator>;
-	using array_type = Vc::Memory<floatv>;
 	using matrix_type = MatrixV<floatv>;
 
+	// rows are addressed as plain values in between the vectors, as in
+	// Vc::Memory
+	static_assert(sizeof(floatv) == floatv::Size * sizeof(value_type),
+				  "vectors must be packed arrays of their values");
+
+	// one column within the slab, like the Vc::Memory columns used to be
+	template<typename vectorPointer_T>
+	class Column {
+	public:
+		Column(vectorPointer_T data, size_t rows, size_t vectors)
+			: m_data(data), m_rows(rows), m_vectors(vectors) {}
+
+		inline auto& vector(size_t i) const { return m_data[i]; }
+		inline auto& operator[](size_t i) const { return entries()[i]; }
+		inline auto entries() const {
+			using entry_type = std::conditional_t<
+				std::is_const<std::remove_pointer_t<vectorPointer_T>>::value,
+				const value_type, value_type>;
+			return reinterpret_cast<entry_type*>(m_data);
+		}
+		inline size_t vectorsCount() const { return m_vectors; }
+		inline size_t entriesCount() const { return m_rows; }
+
+	private:
+		vectorPointer_T m_data;
+		size_t m_rows;
+		size_t m_vectors;
+	};  // end class Column
+
+	using array_type = Column<floatv*>;
+	using const_array_type = Column<const floatv*>;
+
 public:
 	MatrixV() = delete;
 	MatrixV(int rows, int columns, value_type defaultValue)
-		: m_rows(rows), m_data() {
+		: m_rows(rows),
+		  m_vectors((rows + floatv::Size - 1) / floatv::Size),
+		  m_stride(Slab::roundUp(m_vectors * sizeof(floatv), Slab::CacheLine) /
+				   sizeof(floatv)),
+		  m_columns(0),
+		  m_capacity(0),
+		  m_slab(nullptr, Slab::Deleter{0, false}) {
 		init(columns, defaultValue);
 	}
 
-	MatrixV(const matrix_type& other) = default;
-	MatrixV(matrix_type&& other) = default;
+	MatrixV(const matrix_type& other)
+		: m_rows(other.m_rows),
+		  m_vectors(other.m_vectors),
+		  m_stride(other.m_stride),
+		  m_columns(0),
+		  m_capacity(0),
+		  m_slab(nullptr, Slab::Deleter{0, false}) {
+		grow(other.m_columns);
+		m_columns = other.m_columns;
+		// copied by the calling thread, so a replica lands on its NUMA node
+		if (m_columns > 0) {
+			std::memcpy(data(), other.data(),
+						m_columns * m_stride * sizeof(floatv));
+		}
+	}
 
-	matrix_type& operator=(const matrix_type& rhs) = default;
-	matrix_type& operator=(matrix_type&& rhs) = default;
-	
-/*
-	MatrixV(MatrixV&& other)
-		: m_rows(other.m_rows), m_data(std::move(other.m_data)) {}
-*/
+	MatrixV(matrix_type&& other) noexcept
+		: m_rows(other.m_rows),
+		  m_vectors(other.m_vectors),
+		  m_stride(other.m_stride),
+		  m_columns(std::exchange(other.m_columns, 0)),
+		  m_capacity(std::exchange(other.m_capacity, 0)),
+		  m_slab(std::move(other.m_slab)) {}
 
-	// return type must be auto, since Vc::memory returns complicated wrapper
-	// types here
+	matrix_type& operator=(const matrix_type& rhs) {
+		if (this != &rhs) {
+			*this = matrix_type{rhs};
+		}
+		return *this;
+	}
+
+	matrix_type& operator=(matrix_type&& rhs) noexcept {
+		m_rows = rhs.m_rows;
+		m_vectors = rhs.m_vectors;
+		m_stride = rhs.m_stride;
+		m_columns = std::exchange(rhs.m_columns, 0);
+		m_capacity = std::exchange(rhs.m_capacity, 0);
+		m_slab = std::move(rhs.m_slab);
+		return *this;
+	}
+
+	// return type must be auto, since Vc vectors of some types come with
+	// complicated wrapper types here
 inline 	auto& vector(int row, int column) {
-	return m_data[column].vector(row);
+	return data()[column * m_stride + row];
 	}
 
 inline 	const auto& vector(int row, int column) const {
-	return m_data[column].vector(row);
+	return data()[column * m_stride + row];
 	}
 
 	value_type& operator()(int row, int column) {
-		return m_data[column][row];
+		return reinterpret_cast<value_type*>(data() + column * m_stride)[row];
 	}
 
 	const value_type& operator()(int row, int column) const {
-		return m_data[column][row];
+		return reinterpret_cast<const value_type*>(data() +
+												   column * m_stride)[row];
 	}
 
-array_type& column(size_t column) {
-	return m_data[column];
+array_type column(size_t column) {
+	return array_type{data() + column * m_stride, m_rows, m_vectors};
 }
 
-	const array_type& column(size_t column) const {
-		return m_data[column];
+	const_array_type column(size_t column) const {
+		return const_array_type{data() + column * m_stride, m_rows, m_vectors};
 	}
 
 	size_t vectorsCountPerColumn() const {
-		if(m_data.size() == 0) {
+		if(m_columns == 0) {
 			return 0;
 		}
 		
-		return m_data[0].vectorsCount();
+		return m_vectors;
 	}
 
-	size_t columns() const { return m_data.size(); }
+	size_t columns() const { return m_columns; }
 
 	size_t rows() const { return m_rows; }
 
+	// distance between the first vectors of neighbouring columns, at least
+	// vectorsCountPerColumn and always a whole number of cache lines
+	size_t stride() const { return m_stride; }
+
+	// columns added are uninitialized. Growing moves the matrix to a new slab
+	// of at least twice the capacity, so a trellis reserved for ever longer
+	// sentences is copied a logarithmic number of times
 	void reserve(size_t columns) {
-		const auto c = m_data.size();
-		if(columns <= c) {
+		if(columns <= m_columns) {
 			return;
 		}
 
-		for(size_t j = 0; j < columns - c; ++j) {
-			m_data.emplace_back(m_rows);
+		if(columns > m_capacity) {
+			grow(std::max(columns, 2 * m_capacity));
 		}
-
+		m_columns = columns;
 	}
 
 
 private:
+	inline floatv* data() { return static_cast<floatv*>(m_slab.get()); }
 
-	inline void init(size_t columns, const value_type& value) {
-		const auto tmp = floatv(value);
-		m_data.reserve(columns);
-		for(size_t j = 0; j < columns; ++j) {
-			m_data.emplace_back(m_rows);
-			auto& mem = m_data[j];
-			for(size_t i = 0; i < mem.vectorsCount(); ++i) {
-				mem.vector(i) = tmp;
-			}
+	inline const floatv* data() const {
+		return static_cast<const floatv*>(m_slab.get());
+	}
+
+	// keeps the first m_columns columns
+	void grow(size_t capacity) {
+		auto slab = Slab::allocate(capacity * m_stride * sizeof(floatv));
+		if (m_columns > 0) {
+			std::memcpy(slab.get(), m_slab.get(),
+						m_columns * m_stride * sizeof(floatv));
 		}
+		m_slab = std::move(slab);
+		m_capacity = capacity;
 	}
 
-/*
-	inline void init(const value_type& value) {
-		const floatv tmp = value;
-		for (size_t i = 0; i < m_data.vectorsCount(); ++i) {
-			m_data.vector(i) = tmp;
+	inline void init(size_t columns, const value_type& value) {
+		const auto tmp = floatv(value);
+		grow(columns);
+		m_columns = columns;
+		// the padding between columns too, so that no byte of the slab is
+		// left uninitialized
+		for(size_t i = 0; i < m_columns * m_stride; ++i) {
+			new (data() + i) floatv(tmp);
 		}
 	}
-*/
+
 private:
 	size_t m_rows;
-	std::vector<array_type> m_data;
+	// vectors holding the rows of one column
+	size_t m_vectors;
+	// vectors from one column to the next
+	size_t m_stride;
+	size_t m_columns;
+	// columns the slab has room for
+	size_t m_capacity;
+	Slab::pointer_type m_slab;
 };  // end class MatrixV
 
 /*
@@ -0,0 +1,156 @@
+#ifndef PARATERBI__MICROBATCHER_HPP__
+#define PARATERBI__MICROBATCHER_HPP__
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Collects sentences submitted by many threads into batches for one decoder.
+// A batch is closed as soon as it is full or its oldest sentence has waited
+// maxWait; while the decoder is busy the next batch keeps filling up.
+template <typename viterbi_T>
+class MicroBatcher {
+public:
+	using Viterbi_type = viterbi_T;
+	using Label_type = typename Viterbi_type::Label_type;
+	using Emission_type = typename Viterbi_type::Emission_type;
+	using clock = std::chrono::steady_clock;
+
+	struct Timing {
+		// microseconds from submit until the batch was handed to the decoder
+		double queued;
+		// microseconds the whole batch took to decode
+		double decoded;
+		// sentences decoded together with this one (including it)
+		size_t batch;
+	};
+
+	struct Result {
+		std::vector<Label_type> labels;
+		Timing timing;
+	};
+
+public:
+	MicroBatcher() = delete;
+	MicroBatcher(Viterbi_type decoder, size_t maxBatch,
+				 std::chrono::microseconds maxWait)
+		: m_decoder(std::move(decoder)),
+		  m_maxBatch(std::max<size_t>(1, maxBatch)),
+		  m_maxWait(maxWait),
+		  m_stop(false),
+		  m_thread() {
+		m_thread = std::thread{&MicroBatcher::run, this};
+	}
+
+	MicroBatcher(const MicroBatcher& other) = delete;
+	MicroBatcher& operator=(const MicroBatcher& rhs) = delete;
+
+	// sentences still queued are decoded before the batcher goes away
+	~MicroBatcher() {
+		{
+			auto lock = std::lock_guard<std::mutex>{m_mutex};
+			m_stop = true;
+		}
+		m_wakeup.notify_one();
+		m_thread.join();
+	}
+
+	std::future<Result> submit(std::vector<Emission_type> ts) {
+		auto pending = Pending{std::move(ts), std::promise<Result>{},
+							   clock::now()};
+		auto result = pending.promise.get_future();
+		{
+			auto lock = std::lock_guard<std::mutex>{m_mutex};
+			m_queue.push_back(std::move(pending));
+		}
+		m_wakeup.notify_one();
+		return result;
+	}
+
+private:
+	struct Pending {
+		std::vector<Emission_type> ts;
+		std::promise<Result> promise;
+		clock::time_point submitted;
+	};
+
+	void run() {
+		auto batch = std::vector<Pending>{};
+		auto input = std::vector<std::vector<Emission_type>>{};
+		batch.reserve(m_maxBatch);
+		input.reserve(m_maxBatch);
+
+		while (true) {
+			{
+				auto lock = std::unique_lock<std::mutex>{m_mutex};
+				m_wakeup.wait(lock,
+							  [this]() { return m_stop || !m_queue.empty(); });
+				if (m_queue.empty()) {
+					// stopped and drained
+					return;
+				}
+				const auto deadline = m_queue.front().submitted + m_maxWait;
+				m_wakeup.wait_until(lock, deadline, [this]() {
+					return m_stop || m_queue.size() >= m_maxBatch;
+				});
+
+				const auto n = std::min(m_maxBatch, m_queue.size());
+				for (size_t i = 0; i < n; ++i) {
+					batch.push_back(std::move(m_queue.front()));
+					m_queue.pop_front();
+				}
+			}
+
+			for (auto& p : batch) {
+				input.push_back(std::move(p.ts));
+			}
+
+			const auto started = clock::now();
+			auto error = std::exception_ptr{};
+			auto labels = std::vector<std::vector<Label_type>>{};
+			try {
+				labels = m_decoder.inferBatch(input);
+			} catch (...) {
+				error = std::current_exception();
+			}
+			const auto finished = clock::now();
+
+			const auto decoded = microseconds(finished - started);
+			for (size_t i = 0; i < batch.size(); ++i) {
+				if (error) {
+					batch[i].promise.set_exception(error);
+					continue;
+				}
+				batch[i].promise.set_value(
+					Result{std::move(labels[i]),
+						   Timing{microseconds(started - batch[i].submitted),
+								  decoded, batch.size()}});
+			}
+			batch.clear();
+			input.clear();
+		}
+	}
+
+	static double microseconds(clock::duration d) {
+		return std::chrono::duration<double, std::micro>(d).count();
+	}
+
+private:
+	Viterbi_type m_decoder;
+	const size_t m_maxBatch;
+	const std::chrono::microseconds m_maxWait;
+	std::mutex m_mutex;
+	std::condition_variable m_wakeup;
+	std::deque<Pending> m_queue;
+	bool m_stop;
+	// declared last: started once everything above is initialized
+	std::thread m_thread;
+};  // end class MicroBatcher
+
+#endif
@@ -0,0 +1,290 @@
+#ifndef PARATERBI__PERFCOUNTERS_HPP__
+#define PARATERBI__PERFCOUNTERS_HPP__
+
+// Hardware counters around the phases of the Viterbi kernel, compiled in with
+// -DVITERBI_PERF_COUNTERS (cmake -DPERF_COUNTERS=ON) and free otherwise.
+//
+// Every thread that runs a phase opens its own perf_event_open group
+// (cycles, instructions, L1D read misses, LLC misses, branch misses) for
+// itself on first use and adds the counter deltas of every phase it runs to
+// totals that outlive it. PerfCounters::report prints them per thread and
+// phase with IPC and the bytes per trellis cell that missed L1D and LLC (one
+// cache line per miss): a phase with low IPC and many LLC bytes per cell is
+// memory-bound, one with high IPC and few is compute-bound.
+//
+// Each phase costs two read() system calls, so sentences of a few words get
+// measurably slower while counting.
+
+#ifdef VITERBI_PERF_COUNTERS
+
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+enum class PerfPhase { FirstColumn, Columns, Backtrace };
+
+class PerfCounters {
+public:
+	enum Event {
+		Cycles,
+		Instructions,
+		L1dMisses,
+		LlcMisses,
+		BranchMisses,
+		EventCount
+	};
+	static const int PhaseCount = 3;
+	static const int CacheLine = 64;
+
+	using Sample = std::array<uint64_t, EventCount>;
+
+	// what one thread spent in one phase
+	struct Totals {
+		std::atomic<uint64_t> calls{0};
+		std::atomic<uint64_t> cells{0};
+		std::atomic<uint64_t> nanoseconds{0};
+		std::array<std::atomic<uint64_t>, EventCount> events{};
+	};
+
+	struct ThreadTotals {
+		long tid;
+		std::array<Totals, PhaseCount> phases;
+	};
+
+public:
+	PerfCounters(const PerfCounters& other) = delete;
+	PerfCounters& operator=(const PerfCounters& rhs) = delete;
+
+	~PerfCounters() {
+		for (auto fd : m_fds) {
+			if (fd >= 0) ::close(fd);
+		}
+	}
+
+	// the counters of the calling thread, opened on first use
+	static PerfCounters& current() {
+		thread_local PerfCounters counters;
+		return counters;
+	}
+
+	inline bool available() const { return m_fds[Cycles] >= 0; }
+
+	// events that could not be opened read as 0
+	inline void read(Sample& sample) const {
+		sample.fill(0);
+		if (!available()) return;
+
+		// PERF_FORMAT_GROUP: the number of events, then their values in the
+		// order they joined the group
+		uint64_t buffer[1 + EventCount];
+		if (::read(m_fds[Cycles], buffer, sizeof(buffer)) <= 0) return;
+		for (int e = 0; e < EventCount; ++e) {
+			const auto slot = m_slots[e];
+			if (slot >= 0 && static_cast<uint64_t>(slot) < buffer[0]) {
+				sample[e] = buffer[1 + slot];
+			}
+		}
+	}
+
+	inline void add(PerfPhase phase, uint64_t cells, const Sample& before,
+					const Sample& after, uint64_t nanoseconds) {
+		auto& t = m_totals->phases[static_cast<int>(phase)];
+		t.calls.fetch_add(1, std::memory_order_relaxed);
+		t.cells.fetch_add(cells, std::memory_order_relaxed);
+		t.nanoseconds.fetch_add(nanoseconds, std::memory_order_relaxed);
+		for (int e = 0; e < EventCount; ++e) {
+			t.events[e].fetch_add(after[e] - before[e],
+								  std::memory_order_relaxed);
+		}
+	}
+
+	// totals of every thread that ever ran a phase, and of all of them
+	static void report(std::ostream& out) {
+		auto& r = registry();
+		auto lock = std::lock_guard<std::mutex>{r.mutex};
+
+		if (r.error != 0) {
+			out << "perf_event_open failed (" << std::strerror(r.error)
+				<< "), only calls, cells and time are counted\n";
+		}
+		out << std::setw(8) << "thread" << std::setw(13) << "phase"
+			<< std::setw(10) << "calls" << std::setw(12) << "cells"
+			<< std::setw(10) << "ms" << std::setw(7) << "IPC" << std::setw(10)
+			<< "cyc/cell" << std::setw(11) << "L1D B/cell" << std::setw(11)
+			<< "LLC B/cell" << std::setw(14) << "brmiss/kcell" << "\n";
+
+		auto all = ThreadTotals{};
+		all.tid = 0;
+		for (const auto& t : r.threads) {
+			for (int p = 0; p < PhaseCount; ++p) {
+				accumulate(all.phases[p], t->phases[p]);
+				line(out, std::to_string(t->tid), p, t->phases[p]);
+			}
+		}
+		for (int p = 0; p < PhaseCount; ++p) {
+			line(out, "all", p, all.phases[p]);
+		}
+	}
+
+private:
+	struct Registry {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<ThreadTotals>> threads;
+		// errno of the first failed attempt to open the counters
+		int error = 0;
+	};
+
+	static Registry& registry() {
+		static Registry r;
+		return r;
+	}
+
+	PerfCounters() : m_fds(), m_slots(), m_totals(nullptr) {
+		m_fds.fill(-1);
+		m_slots.fill(-1);
+
+		const auto cache = [](uint64_t level) {
+			return level | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+				   (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		};
+		const std::array<std::pair<uint32_t, uint64_t>, EventCount> events{{
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+			{PERF_TYPE_HW_CACHE, cache(PERF_COUNT_HW_CACHE_L1D)},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+			{PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+		}};
+
+		auto error = 0;
+		auto slot = 0;
+		for (int e = 0; e < EventCount; ++e) {
+			m_fds[e] = open(events[e].first, events[e].second, m_fds[Cycles]);
+			if (m_fds[e] >= 0) {
+				m_slots[e] = slot++;
+			} else if (e == Cycles) {
+				// no group without its leader
+				error = errno;
+				break;
+			}
+		}
+
+		auto totals = std::make_unique<ThreadTotals>();
+		totals->tid = ::syscall(SYS_gettid);
+		m_totals = totals.get();
+
+		auto& r = registry();
+		auto lock = std::lock_guard<std::mutex>{r.mutex};
+		r.threads.push_back(std::move(totals));
+		if (r.error == 0) r.error = error;
+	}
+
+	// counts the calling thread in user space on any cpu
+	static int open(uint32_t type, uint64_t config, int group) {
+		auto attr = perf_event_attr{};
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.read_format = PERF_FORMAT_GROUP;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		return ::syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+	}
+
+	static void accumulate(Totals& sum, const Totals& t) {
+		sum.calls += t.calls.load();
+		sum.cells += t.cells.load();
+		sum.nanoseconds += t.nanoseconds.load();
+		for (int e = 0; e < EventCount; ++e) {
+			sum.events[e] += t.events[e].load();
+		}
+	}
+
+	static void line(std::ostream& out, const std::string& thread, int phase,
+					 const Totals& t) {
+		static const char* names[PhaseCount] = {"first column", "columns",
+												"backtrace"};
+		const auto calls = t.calls.load();
+		if (calls == 0) return;
+
+		const auto cells = std::max<double>(1, t.cells.load());
+		const auto event = [&t](Event e) {
+			return static_cast<double>(t.events[e].load());
+		};
+		out << std::fixed << std::setprecision(2) << std::setw(8) << thread
+			<< std::setw(13) << names[phase] << std::setw(10) << calls
+			<< std::setw(12) << t.cells.load() << std::setw(10)
+			<< t.nanoseconds.load() / 1e6 << std::setw(7)
+			<< event(Instructions) / std::max(1.0, event(Cycles))
+			<< std::setw(10) << event(Cycles) / cells << std::setw(11)
+			<< event(L1dMisses) * CacheLine / cells << std::setw(11)
+			<< event(LlcMisses) * CacheLine / cells << std::setw(14)
+			<< event(BranchMisses) * 1000 / cells << "\n";
+	}
+
+private:
+	std::array<int, EventCount> m_fds;
+	// position of each event in the group's read buffer, -1 if not opened
+	std::array<int, EventCount> m_slots;
+	// owned by the registry, so that it survives the thread
+	ThreadTotals* m_totals;
+};  // end class PerfCounters
+
+// counts everything the calling thread does until the end of the scope as
+// one call of phase, covering the given number of trellis cells
+class PerfScope {
+public:
+	using clock = std::chrono::steady_clock;
+
+	PerfScope(PerfPhase phase, uint64_t cells)
+		: m_counters(PerfCounters::current()),
+		  m_phase(phase),
+		  m_cells(cells),
+		  m_before(),
+		  m_started(clock::now()) {
+		m_counters.read(m_before);
+	}
+
+	PerfScope(const PerfScope& other) = delete;
+	PerfScope& operator=(const PerfScope& rhs) = delete;
+
+	~PerfScope() {
+		auto after = PerfCounters::Sample{};
+		m_counters.read(after);
+		const auto elapsed = std::chrono::duration_cast<std::chrono::nanoseconds>(
+			clock::now() - m_started);
+		m_counters.add(m_phase, m_cells, m_before, after, elapsed.count());
+	}
+
+private:
+	PerfCounters& m_counters;
+	const PerfPhase m_phase;
+	const uint64_t m_cells;
+	PerfCounters::Sample m_before;
+	const clock::time_point m_started;
+};  // end class PerfScope
+
+#define VITERBI_PERF_SCOPE(phase, cells) \
+	const auto perfScope =                \
+		PerfScope { PerfPhase::phase, static_cast<uint64_t>(cells) }
+
+#else
+
+#define VITERBI_PERF_SCOPE(phase, cells)
+
+#endif
+
+#endif
@@ -0,0 +1,322 @@
+#ifndef PARATERBI__PIPELINE_HPP__
+#define PARATERBI__PIPELINE_HPP__
+
+#include "Trace.hpp"
+#include "utility.hpp"
+
+#include <boost/lockfree/spsc_queue.hpp>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <istream>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Tags a stream of sentences in four stages, each on its own thread:
+//
+//   read (caller) -> lookup (toEmissions) -> decode -> format and write
+//
+// Stages hand whole batches of sentences to each other through single
+// producer/single consumer lock-free queues, so the order of the input is
+// kept. A stage that finds its queue empty spins only briefly and then sleeps
+// until a batch arrives, idle stages leave the cores to the decoder's
+// workers. A fixed number of batches circulates and finished ones are handed
+// back to the reader: when the decoder falls behind the reader runs out of
+// batches and waits, memory stays bounded and steady state does not allocate.
+//
+// In Format::Binary sentences arrive as a uint32 word count followed by as
+// many uint32 emission ids, and leave as a uint32 label count followed by as
+// many uint16 label ids, all in host byte order. No strings are involved
+// then, the lookup stage passes batches on untouched. Frames of more than
+// MaxFrameWords words are rejected.
+enum class Format { Text, Binary };
+
+template <typename hmm_T>
+class Pipeline {
+public:
+	using Hmm_type = hmm_T;
+	using Label_type = typename Hmm_type::Label_type;
+	using Emission_type = typename Hmm_type::Emission_type;
+
+	static const uint32_t MaxFrameWords = uint32_t{1} << 20;
+
+public:
+	Pipeline() = delete;
+	// depth batches of batchSize sentences are in flight at most, below four
+	// some stage always idles
+	Pipeline(Hmm_type& hmm, size_t batchSize, Format format = Format::Text,
+			 size_t depth = 4)
+		: m_hmm(hmm),
+		  m_format(format),
+		  m_batchSize(std::max<size_t>(1, batchSize)),
+		  m_batches(),
+		  m_free(std::max<size_t>(1, depth)),
+		  m_read(std::max<size_t>(1, depth)),
+		  m_looked(std::max<size_t>(1, depth)),
+		  m_decoded(std::max<size_t>(1, depth)),
+		  m_failed(false),
+		  m_error() {
+		for (size_t i = 0; i < std::max<size_t>(1, depth); ++i) {
+			m_batches.push_back(std::make_unique<Batch>());
+			m_free.batches.push(m_batches.back().get());
+		}
+	}
+
+	Pipeline(const Pipeline& other) = delete;
+	Pipeline& operator=(const Pipeline& rhs) = delete;
+
+	// reads "word\n" lines with an empty line after every sentence from in
+	// until it ends and writes "word\tlabel\n" lines in the same layout to out
+	// (or frames, see Format)
+	void run(std::istream& in, std::ostream& out) {
+		if (m_format == Format::Binary && m_hmm.labelCount() > UINT16_MAX + 1) {
+			throw std::invalid_argument{"too many labels for binary output"};
+		}
+
+		auto lookup = std::thread{[this]() {
+			stage(m_read, m_looked, [this](Batch& b) {
+				if (m_format == Format::Binary) return;
+				VITERBI_TRACE_SPAN(Lookup, b.words.size());
+				b.emissions.resize(b.words.size());
+				for (size_t s = 0; s < b.words.size(); ++s) {
+					b.emissions[s] = m_hmm.toEmissions(b.words[s]);
+				}
+			});
+		}};
+		auto decode = std::thread{[this]() {
+			stage(m_looked, m_decoded, [this](Batch& b) {
+				VITERBI_TRACE_SPAN(Decode, b.emissions.size());
+				b.labels = m_hmm.inferBatch(b.emissions);
+			});
+		}};
+		auto format = std::thread{[this, &out]() {
+			stage(m_decoded, m_free, [this, &out](Batch& b) {
+				VITERBI_TRACE_SPAN(Format, b.labels.size());
+				if (m_format == Format::Binary) {
+					writeFrames(b, out);
+					return;
+				}
+				for (size_t s = 0; s < b.words.size(); ++s) {
+					const auto tags = m_hmm.toLabels(b.labels[s]);
+					for (size_t i = 0; i < b.words[s].size(); ++i) {
+						b.text << b.words[s][i] << "\t" << tags[i] << "\n";
+					}
+					b.text << "\n";
+				}
+				out << b.text.str();
+			});
+		}};
+
+		if (m_format == Format::Binary) {
+			read([this, &in](Batch& b) { return readFrames(in, b); });
+		} else {
+			read([this, &in](Batch& b) { return readLines(in, b); });
+		}
+
+		lookup.join();
+		decode.join();
+		format.join();
+		if (m_error) {
+			std::rethrow_exception(m_error);
+		}
+	}
+
+private:
+	struct Batch {
+		std::vector<std::vector<std::string>> words;
+		std::vector<std::vector<Emission_type>> emissions;
+		std::vector<std::vector<Label_type>> labels;
+		std::ostringstream text;
+		// Format::Binary output
+		std::vector<char> frames;
+		// no batch follows this one
+		bool last = false;
+	};
+
+	// a batch is handed over under the mutex: it is one lock per batch and
+	// stage, and no wake-up can get lost between a consumer's last look and
+	// its wait
+	struct Queue {
+		explicit Queue(size_t capacity) : batches(capacity) {}
+		boost::lockfree::spsc_queue<Batch*> batches;
+		std::mutex mutex;
+		std::condition_variable filled;
+	};
+
+	// hands batches filled by fill(batch) to the lookup stage until fill
+	// returns true at the end of the input. If fill throws the batch still
+	// goes on, marked last, so that all stages finish and run rethrows.
+	template <typename fill_T>
+	void read(fill_T fill) {
+		for (auto last = false; !last;) {
+			auto& b = *pop(m_free);
+			try {
+				last = fill(b);
+			} catch (...) {
+				fail(std::current_exception());
+			}
+			b.last = last || m_failed;
+			last = b.last;
+			push(m_read, &b);
+		}
+	}
+
+	bool readLines(std::istream& in, Batch& b) {
+		VITERBI_TRACE_SPAN(Read, m_batchSize);
+		// sentences are cleared, not released, so their capacity is reused
+		b.words.resize(m_batchSize);
+		b.words[0].clear();
+		b.text.str("");
+		auto line = std::string{};
+		auto n = size_t{0};
+		auto last = false;
+		while (n < m_batchSize) {
+			if (!std::getline(in, line).good()) {
+				last = true;
+				break;
+			}
+			if (line != "") {
+				b.words[n].push_back(line);
+			} else if (++n < m_batchSize) {
+				b.words[n].clear();
+			}
+		}
+		b.words.resize(n);
+		return last;
+	}
+
+	bool readFrames(std::istream& in, Batch& b) {
+		VITERBI_TRACE_SPAN(Read, m_batchSize);
+		// ids are read in blocks of this many, so that a frame only takes
+		// memory for the words actually sent
+		static const uint32_t Block = 4096;
+		uint32_t ids[Block];
+		// per batch, updates may add words
+		const auto emissions = static_cast<uint32_t>(m_hmm.emissionCount());
+		b.emissions.resize(m_batchSize);
+		auto n = size_t{0};
+		while (n < m_batchSize) {
+			auto count = uint32_t{0};
+			if (!in.read(reinterpret_cast<char*>(&count), sizeof(count))) {
+				if (in.gcount() != 0) truncated();
+				break;
+			}
+			if (count > MaxFrameWords) {
+				fail(std::make_exception_ptr(std::runtime_error{
+					"frame of " + std::to_string(count) + " words, at most " +
+					std::to_string(MaxFrameWords) + " are read"}));
+				break;
+			}
+			// ids the model does not know read as the unknown word
+			auto& sentence = b.emissions[n];
+			sentence.clear();
+			for (uint32_t done = 0; done < count;) {
+				const auto k = std::min(count - done, Block);
+				if (!in.read(reinterpret_cast<char*>(ids),
+							 k * sizeof(uint32_t))) {
+					truncated();
+					break;
+				}
+				for (uint32_t i = 0; i < k; ++i) {
+					sentence.push_back(ids[i] < emissions ? ids[i] : 0);
+				}
+				done += k;
+			}
+			if (m_failed) break;
+			++n;
+		}
+		b.emissions.resize(n);
+		return n < m_batchSize;
+	}
+
+	void truncated() {
+		fail(std::make_exception_ptr(
+			std::runtime_error{"input ends within a frame"}));
+	}
+
+	static void writeFrames(Batch& b, std::ostream& out) {
+		auto& f = b.frames;
+		f.clear();
+		for (const auto& labels : b.labels) {
+			append(f, static_cast<uint32_t>(labels.size()));
+			for (const auto l : labels) {
+				append(f, static_cast<uint16_t>(l));
+			}
+		}
+		out.write(f.data(), f.size());
+	}
+
+	template <typename value_T>
+	static inline void append(std::vector<char>& f, value_T value) {
+		const auto bytes = reinterpret_cast<const char*>(&value);
+		f.insert(f.end(), bytes, bytes + sizeof(value));
+	}
+
+	// moves batches from in to out until the last one, applying work to
+	// each unless an earlier stage failed
+	template <typename work_T>
+	void stage(Queue& in, Queue& out, work_T work) {
+		for (auto last = false; !last;) {
+			auto& b = *pop(in);
+			if (!m_failed) {
+				try {
+					work(b);
+				} catch (...) {
+					fail(std::current_exception());
+				}
+			}
+			last = b.last;
+			push(out, &b);
+		}
+	}
+
+	static Batch* pop(Queue& q) {
+		auto b = static_cast<Batch*>(nullptr);
+		VITERBI_TRACE_SPAN(Wait, -1);
+		for (int spins = 0; spins < 1024; ++spins) {
+			if (q.batches.pop(b)) return b;
+		}
+		auto lock = std::unique_lock<std::mutex>{q.mutex};
+		q.filled.wait(lock, [&]() { return q.batches.pop(b); });
+		return b;
+	}
+
+	// never full: every queue can hold all batches
+	static void push(Queue& q, Batch* b) {
+		{
+			auto lock = std::lock_guard<std::mutex>{q.mutex};
+			q.batches.push(b);
+		}
+		q.filled.notify_one();
+	}
+
+	void fail(std::exception_ptr error) {
+		auto lock = std::lock_guard<std::mutex>{m_errorMutex};
+		if (!m_error) m_error = error;
+		m_failed = true;
+	}
+
+private:
+	Hmm_type& m_hmm;
+	const Format m_format;
+	const size_t m_batchSize;
+	std::vector<std::unique_ptr<Batch>> m_batches;
+	Queue m_free;
+	Queue m_read;
+	Queue m_looked;
+	Queue m_decoded;
+	std::atomic<bool> m_failed;
+	std::mutex m_errorMutex;
+	std::exception_ptr m_error;
+};  // end class Pipeline
+
+#endif
@@ -0,0 +1,195 @@
+#ifndef PARATERBI__RESULTCACHE_HPP__
+#define PARATERBI__RESULTCACHE_HPP__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// Bounded LRU cache from sentences (emission ids) to their decoded labels,
+// for input that repeats whole sentences.
+//
+// Sentences are only kept as two independent 64 bit hashes of their ids, so
+// an entry costs its labels and about a hundred bytes of bookkeeping. Two
+// different sentences of the same length would have to collide in all 128
+// bits to be confused.
+//
+// Entries are spread over shards by hash, each with its own lock, list in
+// use order and share of the memory budget, so concurrent decoders rarely
+// wait for each other. clear() drops everything and makes inserts of results
+// looked up before it no-ops, so that nothing decoded with a replaced model
+// gets back in.
+template <typename emission_T, typename label_T>
+class ResultCache {
+public:
+	using Emission_type = emission_T;
+	using Label_type = label_T;
+	using Labels_type = std::vector<Label_type>;
+	static const int ShardCount = 16;
+
+	struct Key {
+		uint64_t first;
+		uint64_t second;
+
+		inline bool operator==(const Key& rhs) const {
+			return first == rhs.first && second == rhs.second;
+		}
+	};
+
+	struct Statistics {
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+		uint64_t evictions = 0;
+		size_t entries = 0;
+		size_t bytes = 0;
+	};
+
+public:
+	ResultCache() = delete;
+	// budget is in bytes, including the bookkeeping of every entry
+	explicit ResultCache(size_t budget)
+		: m_budget(budget),
+		  m_generation(0),
+		  m_hits(0),
+		  m_misses(0),
+		  m_evictions(0),
+		  m_shards(ShardCount) {}
+
+	ResultCache(const ResultCache& other) = delete;
+	ResultCache& operator=(const ResultCache& rhs) = delete;
+
+	static Key key(const std::vector<Emission_type>& ts) {
+		auto first = mix(ts.size() ^ 0x5851f42d4c957f2dULL);
+		auto second = mix(ts.size() ^ 0x14057b7ef767814fULL);
+		for (const auto t : ts) {
+			const auto id = static_cast<uint64_t>(t);
+			first = mix(first ^ id);
+			second = mix(second + id * 0x9e3779b97f4a7c15ULL);
+		}
+		return Key{first, second};
+	}
+
+	// remember the generation before decoding what missed and pass it to
+	// insert
+	inline uint64_t generation() const {
+		return m_generation.load(std::memory_order_acquire);
+	}
+
+	// copies the labels of a cached sentence into labels
+	bool find(const Key& k, Labels_type& labels) {
+		auto& s = shard(k);
+		{
+			auto lock = std::lock_guard<std::mutex>{s.mutex};
+			const auto i = s.index.find(k);
+			if (i != s.index.end()) {
+				s.used.splice(s.used.begin(), s.used, i->second);
+				labels = i->second->labels;
+				m_hits.fetch_add(1, std::memory_order_relaxed);
+				return true;
+			}
+		}
+		m_misses.fetch_add(1, std::memory_order_relaxed);
+		return false;
+	}
+
+	void insert(const Key& k, const Labels_type& labels, uint64_t generation) {
+		const auto bytes = cost(labels);
+		const auto budget = m_budget / ShardCount;
+		if (bytes > budget) return;
+
+		auto& s = shard(k);
+		auto lock = std::lock_guard<std::mutex>{s.mutex};
+		if (generation != m_generation.load(std::memory_order_acquire) ||
+			s.index.count(k) != 0) {
+			return;
+		}
+		while (s.bytes + bytes > budget) {
+			const auto& victim = s.used.back();
+			s.bytes -= cost(victim.labels);
+			s.index.erase(victim.key);
+			s.used.pop_back();
+			m_evictions.fetch_add(1, std::memory_order_relaxed);
+		}
+		s.used.push_front(Entry{k, labels});
+		s.index.emplace(k, s.used.begin());
+		s.bytes += bytes;
+	}
+
+	void clear() {
+		m_generation.fetch_add(1, std::memory_order_acq_rel);
+		for (auto& s : m_shards) {
+			auto lock = std::lock_guard<std::mutex>{s.mutex};
+			s.index.clear();
+			s.used.clear();
+			s.bytes = 0;
+		}
+	}
+
+	Statistics statistics() {
+		auto result = Statistics{};
+		result.hits = m_hits.load(std::memory_order_relaxed);
+		result.misses = m_misses.load(std::memory_order_relaxed);
+		result.evictions = m_evictions.load(std::memory_order_relaxed);
+		for (auto& s : m_shards) {
+			auto lock = std::lock_guard<std::mutex>{s.mutex};
+			result.entries += s.index.size();
+			result.bytes += s.bytes;
+		}
+		return result;
+	}
+
+private:
+	struct Entry {
+		Key key;
+		Labels_type labels;
+	};
+
+	struct KeyHash {
+		inline size_t operator()(const Key& k) const { return k.first; }
+	};
+
+	using List_type = std::list<Entry>;
+
+	struct Shard {
+		std::mutex mutex;
+		// most recently used first
+		List_type used;
+		std::unordered_map<Key, typename List_type::iterator, KeyHash> index;
+		size_t bytes = 0;
+	};
+
+	// splitmix64's finalizer
+	static inline uint64_t mix(uint64_t x) {
+		x += 0x9e3779b97f4a7c15ULL;
+		x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+		return x ^ (x >> 31);
+	}
+
+	// the labels, the list node and the index node with its bucket
+	static inline size_t cost(const Labels_type& labels) {
+		return labels.size() * sizeof(Label_type) + sizeof(Entry) +
+			   2 * sizeof(void*) +
+			   sizeof(std::pair<const Key, typename List_type::iterator>) +
+			   3 * sizeof(void*);
+	}
+
+	// the low bits of first pick the bucket within the shard
+	inline Shard& shard(const Key& k) {
+		return m_shards[(k.first >> 59) % ShardCount];
+	}
+
+private:
+	const size_t m_budget;
+	std::atomic<uint64_t> m_generation;
+	std::atomic<uint64_t> m_hits;
+	std::atomic<uint64_t> m_misses;
+	std::atomic<uint64_t> m_evictions;
+	std::vector<Shard> m_shards;
+};  // end class ResultCache
+
+#endif
@@ -0,0 +1,175 @@
+
+
+#ifndef PARATERBI__TOPOLOGY_HPP__
+#define PARATERBI__TOPOLOGY_HPP__
+
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <pthread.h>
+#include <sched.h>
+
+// where the worker threads of a decoder run
+enum class Placement {
+	Unpinned,  // leave scheduling to the OS
+	Pinned,	// one worker per core, filling one NUMA node after another
+	NumaReplicated  // pinned, and every node reads its own model replica
+};
+
+// cpus grouped by NUMA node, as discovered from /sys. No libnuma required:
+// on machines (or containers) without /sys/devices/system/node everything
+// ends up in a single node.
+class Topology {
+public:
+	Topology() = delete;
+	explicit Topology(std::vector<std::vector<int>> nodes)
+		: m_nodes(std::move(nodes)), m_nodeOfCpu() {
+		for (size_t node = 0; node < m_nodes.size(); ++node) {
+			for (auto cpu : m_nodes[node]) {
+				if (cpu >= static_cast<int>(m_nodeOfCpu.size())) {
+					m_nodeOfCpu.resize(cpu + 1, 0);
+				}
+				m_nodeOfCpu[cpu] = node;
+			}
+		}
+	}
+
+	// the topology of this machine restricted to the cpus this process may
+	// run on; discovered once
+	static const Topology& system() {
+		static const auto topology = discover();
+		return topology;
+	}
+
+	inline int nodes() const { return m_nodes.size(); }
+	inline const std::vector<int>& cpus(int node) const {
+		return m_nodes[node];
+	}
+	inline int nodeOf(int cpu) const { return m_nodeOfCpu[cpu]; }
+
+	// node of the cpu the calling thread happens to run on right now
+	int currentNode() const {
+		const auto cpu = sched_getcpu();
+		return cpu < 0 || cpu >= static_cast<int>(m_nodeOfCpu.size())
+				   ? 0
+				   : m_nodeOfCpu[cpu];
+	}
+
+	int cpuCount() const {
+		auto n = 0;
+		for (const auto& node : m_nodes) n += node.size();
+		return n;
+	}
+
+	// cpu of the i-th worker. Workers fill one node before spilling into the
+	// next, so consecutive label ranges stay on the same socket and a small
+	// pool never leaves the first node.
+	int cpuForWorker(int i) const {
+		auto k = i % cpuCount();
+		for (const auto& node : m_nodes) {
+			if (k < static_cast<int>(node.size())) return node[k];
+			k -= node.size();
+		}
+		return m_nodes[0][0];
+	}
+
+	static bool pin(std::thread& t, int cpu) {
+		return pin(t.native_handle(), cpu);
+	}
+
+	static bool pinCurrent(int cpu) { return pin(pthread_self(), cpu); }
+
+	// "0-3,8,10-11" -> {0, 1, 2, 3, 8, 10, 11}
+	static std::vector<int> parseCpuList(const std::string& list) {
+		auto cpus = std::vector<int>{};
+		auto in = std::istringstream{list};
+		for (std::string range; std::getline(in, range, ',');) {
+			if (range.empty() || range == "\n") continue;
+			const auto dash = range.find('-');
+			try {
+				const auto first = std::stoi(range.substr(0, dash));
+				const auto last = dash == std::string::npos
+									  ? first
+									  : std::stoi(range.substr(dash + 1));
+				for (auto cpu = first; cpu <= last; ++cpu) {
+					cpus.push_back(cpu);
+				}
+			} catch (const std::logic_error&) {
+				// malformed entry, skip it
+			}
+		}
+		return cpus;
+	}
+
+private:
+	static bool pin(pthread_t thread, int cpu) {
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		CPU_SET(cpu, &set);
+		return pthread_setaffinity_np(thread, sizeof(set), &set) == 0;
+	}
+
+	static std::string readLine(const std::string& path) {
+		auto file = std::ifstream{path};
+		auto line = std::string{};
+		std::getline(file, line);
+		return line;
+	}
+
+	static Topology discover() {
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		const bool haveMask =
+			sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+		const auto isAllowed = [&](int cpu) {
+			return !haveMask || (cpu < CPU_SETSIZE && CPU_ISSET(cpu, &allowed));
+		};
+
+		auto nodes = std::vector<std::vector<int>>{};
+		for (int node = 0;; ++node) {
+			auto path = "/sys/devices/system/node/node" +
+						std::to_string(node) + "/cpulist";
+			if (!std::ifstream{path}.good()) {
+				// node ids are dense on every system we know of
+				break;
+			}
+			auto cpus = parseCpuList(readLine(path));
+			cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+									  [&](int cpu) { return !isAllowed(cpu); }),
+					   cpus.end());
+			if (!cpus.empty()) {
+				nodes.push_back(std::move(cpus));
+			}
+		}
+
+		if (nodes.empty()) {
+			auto cpus =
+				parseCpuList(readLine("/sys/devices/system/cpu/online"));
+			if (cpus.empty()) {
+				for (unsigned cpu = 0;
+					 cpu < std::max(1u, std::thread::hardware_concurrency());
+					 ++cpu) {
+					cpus.push_back(cpu);
+				}
+			}
+			cpus.erase(std::remove_if(cpus.begin(), cpus.end(),
+									  [&](int cpu) { return !isAllowed(cpu); }),
+					   cpus.end());
+			if (cpus.empty()) cpus.push_back(0);
+			nodes.push_back(std::move(cpus));
+		}
+
+		return Topology{std::move(nodes)};
+	}
+
+private:
+	std::vector<std::vector<int>> m_nodes;
+	std::vector<int> m_nodeOfCpu;
+};  // end class Topology
+
+#endif
@@ -0,0 +1,173 @@
+#ifndef PARATERBI__TRACE_HPP__
+#define PARATERBI__TRACE_HPP__
+
+// Timeline of what every thread does, compiled in with -DVITERBI_TRACE
+// (cmake -DTRACE=ON) and free otherwise.
+//
+// Every thread records spans (column share, barrier wait, backtrace, the
+// pipeline stages, ...) into a ring buffer of its own, without locks: only
+// the owning thread writes it and publishes each span with a release store.
+// Trace::write prints the spans of all threads as Chrome trace events, to be
+// opened in chrome://tracing or ui.perfetto.dev, where load imbalance across
+// the label ranges of a column and stalls at its barrier show up directly.
+// When a buffer is full its oldest spans are overwritten.
+
+#ifdef VITERBI_TRACE
+
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+enum class TraceKind {
+	FirstColumn,
+	Column,
+	Barrier,
+	Wait,
+	Backtrace,
+	Sentence,
+	Chunk,
+	Subtree,
+	Read,
+	Lookup,
+	Decode,
+	Format
+};
+
+class Trace {
+public:
+	static const int KindCount = 12;
+	// spans kept per thread, 32 bytes each
+	static const size_t Capacity = size_t{1} << 16;
+
+	struct Span {
+		uint64_t begin;
+		uint64_t end;
+		TraceKind kind;
+		// what the span covers, e.g. the column or the first label vector
+		int64_t argument;
+	};
+
+	// the spans of one thread, outliving it
+	struct Buffer {
+		long tid;
+		std::atomic<uint64_t> written{0};
+		std::vector<Span> spans = std::vector<Span>(Capacity);
+	};
+
+public:
+	Trace() = delete;
+
+	static inline uint64_t now() {
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				   std::chrono::steady_clock::now() - epoch())
+			.count();
+	}
+
+	static inline void record(TraceKind kind, uint64_t begin,
+							  int64_t argument) {
+		auto& b = current();
+		const auto i = b.written.load(std::memory_order_relaxed);
+		b.spans[i % Capacity] = Span{begin, now(), kind, argument};
+		b.written.store(i + 1, std::memory_order_release);
+	}
+
+	// the last Capacity spans of every thread. Threads still recording may
+	// overwrite spans while they are written, so call it once decoding is
+	// done.
+	static void write(std::ostream& out) {
+		static const char* names[KindCount] = {
+			"first column", "column", "barrier", "wait",   "backtrace",
+			"sentence",     "chunk",  "subtree", "read",   "lookup",
+			"decode",       "format"};
+
+		auto& r = registry();
+		auto lock = std::lock_guard<std::mutex>{r.mutex};
+		const auto flags = out.flags();
+		out << std::fixed;
+		out.precision(3);
+		out << "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [";
+		auto first = true;
+		for (const auto& b : r.threads) {
+			const auto written = b->written.load(std::memory_order_acquire);
+			const auto begin = written > Capacity ? written - Capacity : 0;
+			for (auto i = begin; i < written; ++i) {
+				const auto& s = b->spans[i % Capacity];
+				out << (first ? "\n" : ",\n") << "{\"name\": \""
+					<< names[static_cast<int>(s.kind)]
+					<< "\", \"ph\": \"X\", \"pid\": 1, \"tid\": " << b->tid
+					<< ", \"ts\": " << s.begin / 1e3
+					<< ", \"dur\": " << (s.end - s.begin) / 1e3
+					<< ", \"args\": {\"argument\": " << s.argument << "}}";
+				first = false;
+			}
+		}
+		out << "\n]}\n";
+		out.flags(flags);
+	}
+
+private:
+	struct Registry {
+		std::mutex mutex;
+		std::vector<std::unique_ptr<Buffer>> threads;
+	};
+
+	static Registry& registry() {
+		static Registry r;
+		return r;
+	}
+
+	static std::chrono::steady_clock::time_point epoch() {
+		static const auto e = std::chrono::steady_clock::now();
+		return e;
+	}
+
+	// the buffer of the calling thread, registered on first use
+	static Buffer& current() {
+		thread_local Buffer* buffer = nullptr;
+		if (buffer == nullptr) {
+			auto b = std::make_unique<Buffer>();
+			b->tid = ::syscall(SYS_gettid);
+			buffer = b.get();
+			auto& r = registry();
+			auto lock = std::lock_guard<std::mutex>{r.mutex};
+			r.threads.push_back(std::move(b));
+		}
+		return *buffer;
+	}
+};  // end class Trace
+
+// records everything until the end of the scope as one span
+class TraceSpan {
+public:
+	TraceSpan(TraceKind kind, int64_t argument)
+		: m_kind(kind), m_argument(argument), m_begin(Trace::now()) {}
+
+	TraceSpan(const TraceSpan& other) = delete;
+	TraceSpan& operator=(const TraceSpan& rhs) = delete;
+
+	~TraceSpan() { Trace::record(m_kind, m_begin, m_argument); }
+
+private:
+	const TraceKind m_kind;
+	const int64_t m_argument;
+	const uint64_t m_begin;
+};  // end class TraceSpan
+
+#define VITERBI_TRACE_SPAN(kind, argument) \
+	const auto traceSpan =                  \
+		TraceSpan { TraceKind::kind, static_cast<int64_t>(argument) }
+
+#else
+
+#define VITERBI_TRACE_SPAN(kind, argument)
+
+#endif
+
+#endif
@@ -0,0 +1,234 @@
+
+
+#include "viterbi.hpp"
+#include "HMM.hpp"
+#include "paraterbi.h"
+
+#include <fstream>
+#include <memory>
+#include <new>
+#include <string>
+#include <vector>
+
+using Hmm_type = HMM<Viterbi<double>>;
+using Viterbi_type = Hmm_type::Viterbi_type;
+using Emission_type = Hmm_type::Emission_type;
+
+struct paraterbi_model {
+	std::shared_ptr<Hmm_type> hmm;
+};
+
+struct paraterbi_decoder {
+	std::shared_ptr<const Hmm_type> hmm;
+	Viterbi_type viterbi;
+	// kept between calls so that steady state decoding does not allocate
+	std::vector<std::vector<Emission_type>> batch;
+};
+
+namespace {
+
+// no exception may cross the C boundary
+template <typename function_T>
+paraterbi_status guarded(function_T f) {
+	try {
+		return f();
+	} catch (const std::bad_alloc&) {
+		return PARATERBI_ERROR_MEMORY;
+	} catch (...) {
+		return PARATERBI_ERROR_INTERNAL;
+	}
+}
+
+bool validOffsets(const size_t* offsets, size_t count) {
+	if (offsets == nullptr) return false;
+	for (size_t i = 0; i < count; ++i) {
+		if (offsets[i] > offsets[i + 1]) return false;
+	}
+	return true;
+}
+
+// splits the flat input into the decoder's batch, converting every element
+template <typename input_T, typename convert_T>
+void fillBatch(paraterbi_decoder& d, const input_T* input,
+			   const size_t* offsets, size_t count, convert_T convert) {
+	d.batch.resize(count);
+	for (size_t s = 0; s < count; ++s) {
+		auto& ts = d.batch[s];
+		ts.clear();
+		for (auto i = offsets[s]; i < offsets[s + 1]; ++i) {
+			ts.push_back(convert(input[i]));
+		}
+	}
+}
+
+paraterbi_status decodeBatch(paraterbi_decoder& d, const size_t* offsets,
+							 size_t count, int32_t* labels) {
+	const auto results = d.viterbi.inferBatch(d.batch);
+	for (size_t s = 0; s < count; ++s) {
+		std::copy(results[s].cbegin(), results[s].cend(),
+				  labels + offsets[s]);
+	}
+	return PARATERBI_OK;
+}
+
+}  // namespace
+
+extern "C" {
+
+int32_t paraterbi_api_version(void) { return PARATERBI_API_VERSION; }
+
+const char* paraterbi_status_string(paraterbi_status status) {
+	switch (status) {
+		case PARATERBI_OK:
+			return "ok";
+		case PARATERBI_ERROR_IO:
+			return "corpus could not be read";
+		case PARATERBI_ERROR_ARGUMENT:
+			return "invalid argument";
+		case PARATERBI_ERROR_MEMORY:
+			return "out of memory";
+		case PARATERBI_ERROR_INTERNAL:
+			return "internal error";
+	}
+	return "unknown status";
+}
+
+paraterbi_status paraterbi_model_load(const char* corpus_path,
+									  paraterbi_model** model) {
+	if (corpus_path == nullptr || model == nullptr) {
+		return PARATERBI_ERROR_ARGUMENT;
+	}
+	*model = nullptr;
+	if (!std::ifstream{corpus_path}.good()) {
+		return PARATERBI_ERROR_IO;
+	}
+
+	return guarded([&]() {
+		// the model's own decoder is never used, keep it thread-less
+		auto hmm = std::make_shared<Hmm_type>(corpus_path, short{0});
+		if (hmm->labelCount() == 0) {
+			return PARATERBI_ERROR_IO;
+		}
+		*model = new paraterbi_model{std::move(hmm)};
+		return PARATERBI_OK;
+	});
+}
+
+void paraterbi_model_free(paraterbi_model* model) { delete model; }
+
+paraterbi_status paraterbi_model_update(paraterbi_model* model,
+										const char* corpus_path) {
+	if (model == nullptr || corpus_path == nullptr) {
+		return PARATERBI_ERROR_ARGUMENT;
+	}
+	auto file = std::ifstream{corpus_path};
+	if (!file.good()) {
+		return PARATERBI_ERROR_IO;
+	}
+
+	return guarded([&]() {
+		model->hmm->update(file);
+		return PARATERBI_OK;
+	});
+}
+
+int32_t paraterbi_label_count(const paraterbi_model* model) {
+	return model == nullptr ? 0 : model->hmm->labelCount();
+}
+
+int32_t paraterbi_emission_count(const paraterbi_model* model) {
+	return model == nullptr ? 0 : model->hmm->emissionCount();
+}
+
+int32_t paraterbi_emission_id(const paraterbi_model* model,
+							  const char* token) {
+	if (model == nullptr || token == nullptr) return -1;
+	try {
+		return model->hmm->emissionId(token);
+	} catch (...) {
+		return -1;
+	}
+}
+
+const char* paraterbi_label_name(const paraterbi_model* model,
+								 int32_t label) {
+	if (model == nullptr || label < 0 ||
+		label >= model->hmm->labelCount()) {
+		return nullptr;
+	}
+	return model->hmm->labelName(label).c_str();
+}
+
+paraterbi_status paraterbi_decoder_new(const paraterbi_model* model,
+									   int32_t threads,
+									   paraterbi_decoder** decoder) {
+	if (model == nullptr || decoder == nullptr) {
+		return PARATERBI_ERROR_ARGUMENT;
+	}
+	*decoder = nullptr;
+
+	return guarded([&]() {
+		const auto childThreads =
+			threads < 0 ? DefaultOptions::AutoDetermineChildThreads
+						: static_cast<short>(std::min<int32_t>(threads, 1024));
+		*decoder = new paraterbi_decoder{
+			model->hmm, Viterbi_type{model->hmm->modelSlot(), childThreads}, {}};
+		return PARATERBI_OK;
+	});
+}
+
+void paraterbi_decoder_free(paraterbi_decoder* decoder) { delete decoder; }
+
+paraterbi_status paraterbi_decode_ids(paraterbi_decoder* decoder,
+									  const int32_t* ids,
+									  const size_t* offsets, size_t count,
+									  int32_t* labels) {
+	if (decoder == nullptr || !validOffsets(offsets, count)) {
+		return PARATERBI_ERROR_ARGUMENT;
+	}
+	const auto total = offsets[count] - offsets[0];
+	if (total > 0 && (ids == nullptr || labels == nullptr)) {
+		return PARATERBI_ERROR_ARGUMENT;
+	}
+
+	const auto emissions = decoder->hmm->emissionCount();
+	for (auto i = offsets[0]; i < offsets[count]; ++i) {
+		if (ids[i] < 0 || ids[i] >= emissions) {
+			return PARATERBI_ERROR_ARGUMENT;
+		}
+	}
+
+	return guarded([&]() {
+		fillBatch(*decoder, ids, offsets, count,
+				  [](int32_t id) { return static_cast<Emission_type>(id); });
+		return decodeBatch(*decoder, offsets, count, labels);
+	});
+}
+
+paraterbi_status paraterbi_decode_tokens(paraterbi_decoder* decoder,
+										 const char* const* tokens,
+										 const size_t* offsets, size_t count,
+										 int32_t* labels) {
+	if (decoder == nullptr || !validOffsets(offsets, count)) {
+		return PARATERBI_ERROR_ARGUMENT;
+	}
+	const auto total = offsets[count] - offsets[0];
+	if (total > 0 && (tokens == nullptr || labels == nullptr)) {
+		return PARATERBI_ERROR_ARGUMENT;
+	}
+	for (auto i = offsets[0]; i < offsets[count]; ++i) {
+		if (tokens[i] == nullptr) {
+			return PARATERBI_ERROR_ARGUMENT;
+		}
+	}
+
+	return guarded([&]() {
+		const auto& hmm = *decoder->hmm;
+		fillBatch(*decoder, tokens, offsets, count, [&hmm](const char* t) {
+			return std::max<Emission_type>(0, hmm.emissionId(t));
+		});
+		return decodeBatch(*decoder, offsets, count, labels);
+	});
+}
+
+}  // extern "C"
@@ -0,0 +1,96 @@
+#ifndef PARATERBI__PARATERBI_H__
+#define PARATERBI__PARATERBI_H__
+
+/*
+ * C interface of libparaterbi.
+ *
+ * A model is trained once from a tagged corpus (the format of
+ * data/corpus.txt: "word\ntag\n" pairs, sentences separated by an empty
+ * line) and may be shared by any number of threads. Decoders own the
+ * scratch memory and worker threads of one decoding pipeline; use one
+ * decoder per calling thread.
+ *
+ * Batches are passed as one flat array holding all sentences back to back
+ * plus count + 1 offsets: sentence i spans [offsets[i], offsets[i + 1]).
+ * The labels of the whole batch are written to a flat array of
+ * offsets[count] entries in the same layout.
+ *
+ * Only opaque handles, fixed width integers and plain C strings cross this
+ * interface; it stays binary compatible as long as PARATERBI_API_VERSION
+ * does not change.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define PARATERBI_EXPORT __declspec(dllexport)
+#else
+#define PARATERBI_EXPORT __attribute__((visibility("default")))
+#endif
+
+#define PARATERBI_API_VERSION 1
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct paraterbi_model paraterbi_model;
+typedef struct paraterbi_decoder paraterbi_decoder;
+
+typedef enum paraterbi_status {
+	PARATERBI_OK = 0,
+	PARATERBI_ERROR_IO = 1,		   /* corpus could not be read */
+	PARATERBI_ERROR_ARGUMENT = 2,  /* null pointer, bad offsets or ids */
+	PARATERBI_ERROR_MEMORY = 3,
+	PARATERBI_ERROR_INTERNAL = 4
+} paraterbi_status;
+
+/* PARATERBI_API_VERSION of the loaded library */
+PARATERBI_EXPORT int32_t paraterbi_api_version(void);
+PARATERBI_EXPORT const char* paraterbi_status_string(paraterbi_status status);
+
+/* trains a model from the tagged corpus at corpus_path */
+PARATERBI_EXPORT paraterbi_status
+paraterbi_model_load(const char* corpus_path, paraterbi_model** model);
+/* decoders created from the model keep it alive */
+PARATERBI_EXPORT void paraterbi_model_free(paraterbi_model* model);
+/* adds the tagged sentences at corpus_path to the model's counts and hands
+ * the re-estimated model to all its decoders; calls decoding at the same time
+ * finish with the previous one. New tokens and labels get the next free ids.
+ * Strings returned by paraterbi_label_name before are invalidated. */
+PARATERBI_EXPORT paraterbi_status
+paraterbi_model_update(paraterbi_model* model, const char* corpus_path);
+
+PARATERBI_EXPORT int32_t paraterbi_label_count(const paraterbi_model* model);
+PARATERBI_EXPORT int32_t
+paraterbi_emission_count(const paraterbi_model* model);
+/* id of a token, -1 if the corpus never contained it */
+PARATERBI_EXPORT int32_t paraterbi_emission_id(const paraterbi_model* model,
+											   const char* token);
+/* name of a label id, NULL if out of range; valid as long as the model */
+PARATERBI_EXPORT const char* paraterbi_label_name(
+	const paraterbi_model* model, int32_t label);
+
+/* threads < 0 picks one worker per core, 0 decodes on the calling thread */
+PARATERBI_EXPORT paraterbi_status paraterbi_decoder_new(
+	const paraterbi_model* model, int32_t threads,
+	paraterbi_decoder** decoder);
+PARATERBI_EXPORT void paraterbi_decoder_free(paraterbi_decoder* decoder);
+
+/* decodes emission ids in [0, paraterbi_emission_count) */
+PARATERBI_EXPORT paraterbi_status paraterbi_decode_ids(
+	paraterbi_decoder* decoder, const int32_t* ids, const size_t* offsets,
+	size_t count, int32_t* labels);
+
+/* decodes NUL terminated tokens; unknown tokens are decoded as emission 0,
+ * just like the command line tools do */
+PARATERBI_EXPORT paraterbi_status paraterbi_decode_tokens(
+	paraterbi_decoder* decoder, const char* const* tokens,
+	const size_t* offsets, size_t count, int32_t* labels);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -8,46 +8,234 @@
 #endif
 #if VITERBI_DEVEL_ITERATION==3
 #include "viterbi.hpp"
+#include "viterbi_trigram.hpp"
 #endif
 
 #include <chrono>
 #include "HMM.hpp"
+#include "PerfCounters.hpp"
+#include "Pipeline.hpp"
+#include "Trace.hpp"
+#include "Topology.hpp"
 
-#include <sstream>
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <string>
 
-int main() {
+struct Arguments {
+	std::string corpus = "../data/corpus.txt";
+	// model saved by paraterbi_train, used instead of training from corpus
+	std::string model;
+	short threads = -1;  // AutoDetermineChildThreads
+	Placement placement = Placement::Unpinned;
+	// sentences handed to the decoder at once, and from stage to stage
+	size_t batch = 256;
+	// MiB for decoded sentences, 0 for no cache
+	size_t cache = 0;
+	// decode batches as tries of their sentences' prefixes
+	bool sharePrefixes = false;
+	// length-prefixed ids instead of lines, see Pipeline.hpp
+	Format format = Format::Text;
+	// Chrome trace of all threads, only built with -DVITERBI_TRACE
+	std::string trace;
+	// restricts the model to a banded topology, see Viterbi::Band
+	int bandBack = -1;
+	int bandAhead = 0;
+	// second-order model (TrigramViterbi), optionally without unseen pairs
+	bool trigram = false;
+	bool prune = false;
+};
 
-//	std::ios::sync_with_stdio(false);
-	auto hmm = HMM<Viterbi<double>>{"../data/corpus.txt"};
-	auto line = std::string{};
-	auto ws = std::vector<std::string>{};
-	ws.reserve(10);
-	auto out = std::ostringstream{};
+using Hmm_type = HMM<Viterbi<double>>;
+#if VITERBI_DEVEL_ITERATION==3
+using TrigramHmm_type = HMM<TrigramViterbi<double>>;
+#endif
+
+// nullptr (after saying why) if the model file cannot be read
+std::unique_ptr<Hmm_type> makeHmm(const Arguments& args) {
+	if (args.model.empty()) {
+#if VITERBI_DEVEL_ITERATION==3
+		return std::make_unique<Hmm_type>(args.corpus, args.threads,
+										  args.placement);
+#else
+		return std::make_unique<Hmm_type>(args.corpus);
+#endif
+	}
+
+	auto saved = std::ifstream{args.model};
+	try {
+#if VITERBI_DEVEL_ITERATION==3
+		return std::make_unique<Hmm_type>(saved, args.threads, args.placement);
+#else
+		return std::make_unique<Hmm_type>(saved);
+#endif
+	} catch (const std::exception& e) {
+		std::cerr << args.model << ": " << e.what() << "\n";
+		return nullptr;
+	}
+}
+
+// flags only the parallel version (VITERBI_DEVEL_ITERATION 3) acts upon are
+// accepted and ignored by the others so that run.sh can pass the same ones
+bool parseArguments(int argc, char** argv, Arguments& args) {
+	for (int i = 1; i < argc; ++i) {
+		const auto arg = std::string{argv[i]};
+		// false once the value of a numeric flag does not parse
+		auto valid = true;
+		if (arg == "--corpus" && i + 1 < argc) {
+			args.corpus = argv[++i];
+		} else if (arg == "--model" && i + 1 < argc) {
+			args.model = argv[++i];
+		} else if (arg == "--threads" && i + 1 < argc) {
+			valid = parseNumber(argv[++i], args.threads);
+		} else if (arg == "--pin") {
+			args.placement = Placement::Pinned;
+		} else if (arg == "--numa") {
+			args.placement = Placement::NumaReplicated;
+		} else if (arg == "--batch" && i + 1 < argc) {
+			auto batch = 0;
+			valid = parseNumber(argv[++i], batch);
+			args.batch = std::max(1, batch);
+		} else if (arg == "--band" && i + 1 < argc) {
+			// BACK[,AHEAD]
+			const auto band = std::string{argv[++i]};
+			const auto comma = band.find(',');
+			valid = parseNumber(band.substr(0, comma), args.bandBack);
+			args.bandBack = std::max(0, args.bandBack);
+			if (valid && comma != std::string::npos) {
+				valid = parseNumber(band.substr(comma + 1), args.bandAhead);
+				args.bandAhead = std::max(0, args.bandAhead);
+			}
+		} else if (arg == "--trace" && i + 1 < argc) {
+			args.trace = argv[++i];
+		} else if (arg == "--binary") {
+			args.format = Format::Binary;
+		} else if (arg == "--trigram") {
+			args.trigram = true;
+		} else if (arg == "--prune") {
+			args.prune = true;
+		} else if (arg == "--share-prefixes") {
+			args.sharePrefixes = true;
+		} else if (arg == "--cache" && i + 1 < argc) {
+			auto cache = 0;
+			valid = parseNumber(argv[++i], cache);
+			args.cache = std::max(0, cache);
+		} else {
+			valid = false;
+		}
+		if (!valid) {
+			if (argv[i] != arg) {
+				std::cerr << "invalid value for " << arg << ": " << argv[i]
+						  << "\n";
+			}
+			std::cerr << "usage: " << argv[0]
+					  << " [--corpus FILE | --model FILE] [--threads N]"
+						 " [--pin | --numa]"
+						 " [--batch N] [--cache MIB] [--share-prefixes]"
+						 " [--binary] [--trace FILE] [--band BACK[,AHEAD]]"
+						 " [--trigram [--prune]]\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+// decodes stdin to stdout and reports on stderr, false on errors
+template <typename hmm_T>
+bool run(hmm_T& hmm, const Arguments& args) {
+	hmm.setCacheBudget(args.cache << 20);
+	auto pipeline = Pipeline<hmm_T>{hmm, args.batch, args.format};
 	// meaure wall time
 
 //	auto before = std::chrono::high_resolution_clock::now();
 #ifdef DO_PROFILING
 ProfilerStart("profile.log");
 #endif
-	while (std::getline(std::cin, line).good()) {
-		if (line == "") {
-//			auto before = std::chrono::high_resolution_clock::now();
-			auto tags = hmm.infer(ws);
-//			total += std::chrono::high_resolution_clock::now() - before;
-			for (decltype(ws.size()) i = 0; i < ws.size(); ++i) {
-				out << ws[i] << "\t" << tags[i] << std::endl;
-			}
-			out << std::endl;
-			std::cout << out.str();
-			ws.clear();
-			out.str("");
-		} else {
-			ws.push_back(line);
-		}
-	}  // end while
+	try {
+		pipeline.run(std::cin, std::cout);
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << "\n";
+		return false;
+	}
 #ifdef DO_PROFILING
 ProfilerStop();
 #endif
+#ifdef VITERBI_PERF_COUNTERS
+	PerfCounters::report(std::cerr);
+#endif
+	if (!args.trace.empty()) {
+#ifdef VITERBI_TRACE
+		auto trace = std::ofstream{args.trace};
+		Trace::write(trace);
+#else
+		std::cerr << "--trace needs a build with -DTRACE=ON\n";
+#endif
+	}
+	if (args.cache > 0) {
+		const auto c = hmm.cacheStatistics();
+		std::cerr << "cache: " << c.hits << " hits, " << c.misses
+				  << " misses, " << c.entries << " sentences in " << c.bytes
+				  << " bytes, " << c.evictions << " evicted\n";
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	auto args = Arguments{};
+	if (!parseArguments(argc, argv, args)) {
+		return 1;
+	}
+
+//	std::ios::sync_with_stdio(false);
+#if VITERBI_DEVEL_ITERATION==3
+	if (args.prune && !args.trigram) {
+		std::cerr << "--prune needs --trigram\n";
+		return 1;
+	}
+	if (args.trigram) {
+		if (!args.model.empty()) {
+			std::cerr << "--trigram trains from --corpus, saved models are "
+						 "first-order\n";
+			return 1;
+		}
+		if (args.bandBack >= 0 || args.sharePrefixes ||
+			args.placement == Placement::NumaReplicated) {
+			std::cerr << "--trigram does not support --band, --share-prefixes "
+						 "or --numa\n";
+			return 1;
+		}
+		auto hmm = TrigramHmm_type{args.corpus, args.threads, args.placement};
+		hmm.decoder().setPruning(args.prune);
+		if (!run(hmm, args)) {
+			return 1;
+		}
+		std::cerr << total.count() << std::endl;
+		return 0;
+	}
+#endif
+	const auto hmm = makeHmm(args);
+	if (!hmm) {
+		return 1;
+	}
+#if VITERBI_DEVEL_ITERATION==3
+	hmm->decoder().setPrefixSharing(args.sharePrefixes);
+	if (args.bandBack >= 0) {
+		hmm->setModel(hmm->model()->withBand(
+			Hmm_type::Viterbi_type::Band{args.bandBack, args.bandAhead}));
+	}
+#endif
+	if (!run(*hmm, args)) {
+		return 1;
+	}
+#if VITERBI_DEVEL_ITERATION==3
+	if (args.sharePrefixes) {
+		const auto& p = hmm->decoder().prefixStatistics();
+		std::cerr << "prefix sharing: " << p.columns << " of "
+				  << p.naiveColumns << " columns computed, " << p.cellsSaved
+				  << " cells saved\n";
+	}
+#endif
 
 
 //	auto after = std::chrono::high_resolution_clock::now();
@@ -0,0 +1,158 @@
+#ifndef PARATERBI__SERVER__SOCKET_HPP__
+#define PARATERBI__SERVER__SOCKET_HPP__
+
+#include <cerrno>
+#include <cstring>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// Unix domain stream sockets and the line based protocol spoken over them:
+// a request is one sentence, one word per line, terminated by an empty line.
+// The reply holds one "word\ttag" line per word, one "# ..." timing line and
+// an empty line; a failed request gets a single "# error=..." line instead of
+// both. The last line before the empty one is always the "#" line, tagged
+// lines are never empty, so words starting with '#' cannot be mistaken for it.
+
+// owns a file descriptor
+class Socket {
+public:
+	Socket() : m_fd(-1) {}
+	explicit Socket(int fd) : m_fd(fd) {}
+	Socket(const Socket& other) = delete;
+	Socket(Socket&& other) : m_fd(other.m_fd) { other.m_fd = -1; }
+	Socket& operator=(const Socket& rhs) = delete;
+	Socket& operator=(Socket&& rhs) {
+		std::swap(m_fd, rhs.m_fd);
+		return *this;
+	}
+	~Socket() {
+		if (m_fd >= 0) ::close(m_fd);
+	}
+
+	inline int fd() const { return m_fd; }
+
+	static Socket listen(const std::string& path, int backlog = 128) {
+		auto s = Socket{::socket(AF_UNIX, SOCK_STREAM, 0)};
+		if (s.fd() < 0) fail("socket");
+		const auto address = addressOf(path);
+		// a socket left behind by an earlier server is replaced, anything
+		// else at path is not ours to remove
+		struct stat status {};
+		if (::lstat(path.c_str(), &status) == 0) {
+			if (!S_ISSOCK(status.st_mode)) {
+				throw std::system_error{EADDRINUSE, std::generic_category(),
+										"bind " + path};
+			}
+			::unlink(path.c_str());
+		}
+		if (::bind(s.fd(), reinterpret_cast<const sockaddr*>(&address),
+				   sizeof(address)) != 0) {
+			fail("bind " + path);
+		}
+		if (::listen(s.fd(), backlog) != 0) fail("listen " + path);
+		return s;
+	}
+
+	static Socket connect(const std::string& path) {
+		auto s = Socket{::socket(AF_UNIX, SOCK_STREAM, 0)};
+		if (s.fd() < 0) fail("socket");
+		const auto address = addressOf(path);
+		if (::connect(s.fd(), reinterpret_cast<const sockaddr*>(&address),
+					  sizeof(address)) != 0) {
+			fail("connect " + path);
+		}
+		return s;
+	}
+
+	// an invalid socket on failure (errno tells why), including once the
+	// listening socket has been shut down
+	Socket accept() const {
+		while (true) {
+			const auto fd = ::accept(m_fd, nullptr, nullptr);
+			if (fd >= 0 || errno != EINTR) return Socket{fd};
+		}
+	}
+
+	bool writeAll(const std::string& data) const {
+		for (size_t done = 0; done < data.size();) {
+			const auto n = ::send(m_fd, data.data() + done, data.size() - done,
+								  MSG_NOSIGNAL);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			done += n;
+		}
+		return true;
+	}
+
+private:
+	static sockaddr_un addressOf(const std::string& path) {
+		auto address = sockaddr_un{};
+		address.sun_family = AF_UNIX;
+		if (path.size() >= sizeof(address.sun_path)) {
+			throw std::system_error{ENAMETOOLONG, std::generic_category(),
+									path};
+		}
+		std::strncpy(address.sun_path, path.c_str(),
+					 sizeof(address.sun_path) - 1);
+		return address;
+	}
+
+	[[noreturn]] static void fail(const std::string& what) {
+		throw std::system_error{errno, std::generic_category(), what};
+	}
+
+private:
+	int m_fd;
+};  // end class Socket
+
+// buffered line reader on a socket
+class LineReader {
+public:
+	explicit LineReader(const Socket& socket)
+		: m_fd(socket.fd()), m_buffer(), m_begin(0) {}
+
+	// false once the peer closed the connection (or on error)
+	bool getline(std::string& line) {
+		while (true) {
+			const auto end = m_buffer.find('\n', m_begin);
+			if (end != std::string::npos) {
+				line.assign(m_buffer, m_begin, end - m_begin);
+				m_begin = end + 1;
+				return true;
+			}
+
+			m_buffer.erase(0, m_begin);
+			m_begin = 0;
+			char chunk[4096];
+			const auto n = ::recv(m_fd, chunk, sizeof(chunk), 0);
+			if (n < 0 && errno == EINTR) continue;
+			if (n <= 0) return false;
+			m_buffer.append(chunk, n);
+		}
+	}
+
+	// reads words up to the next empty line; false if the connection ended
+	// first
+	bool getSentence(std::vector<std::string>& ws) {
+		ws.clear();
+		for (auto line = std::string{}; getline(line);) {
+			if (line.empty()) return true;
+			ws.push_back(line);
+		}
+		return false;
+	}
+
+private:
+	int m_fd;
+	std::string m_buffer;
+	size_t m_begin;
+};  // end class LineReader
+
+#endif
@@ -0,0 +1,256 @@
+
+
+#include "server/Socket.hpp"
+#include "utility.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Test client and load generator for paraterbi_server.
+//
+// Without --load it sends the sentences read from stdin (same format as the
+// paraterbi executables read) one by one, prints the tagged sentences to
+// stdout exactly like paraterbi does and the server's timing lines to
+// stderr. With --load N, N connections replay the sentences from stdin in a
+// loop for --seconds and a latency/throughput summary is printed.
+
+using clock_type = std::chrono::steady_clock;
+
+struct Arguments {
+	std::string socket = "paraterbi.sock";
+	int connections = 0;
+	double seconds = 10.0;
+};
+
+bool parseArguments(int argc, char** argv, Arguments& args) {
+	for (int i = 1; i < argc; ++i) {
+		const auto arg = std::string{argv[i]};
+		// false once the value of a numeric flag does not parse
+		auto valid = true;
+		if (arg == "--socket" && i + 1 < argc) {
+			args.socket = argv[++i];
+		} else if (arg == "--load" && i + 1 < argc) {
+			valid = parseNumber(argv[++i], args.connections);
+			args.connections = std::max(1, args.connections);
+		} else if (arg == "--seconds" && i + 1 < argc) {
+			valid = parseNumber(argv[++i], args.seconds);
+		} else {
+			valid = false;
+		}
+		if (!valid) {
+			if (argv[i] != arg) {
+				std::cerr << "invalid value for " << arg << ": " << argv[i]
+						  << "\n";
+			}
+			std::cerr << "usage: " << argv[0]
+					  << " [--socket PATH] [--load CONNECTIONS [--seconds S]]"
+						 " < sentences\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+std::vector<std::vector<std::string>> readSentences(std::istream& in) {
+	auto sentences = std::vector<std::vector<std::string>>{};
+	auto ws = std::vector<std::string>{};
+	for (auto line = std::string{}; std::getline(in, line);) {
+		if (line.empty()) {
+			sentences.push_back(std::move(ws));
+			ws.clear();
+		} else {
+			ws.push_back(line);
+		}
+	}
+	return sentences;
+}
+
+std::string request(const std::vector<std::string>& ws) {
+	auto out = std::string{};
+	for (const auto& w : ws) {
+		out += w;
+		out += '\n';
+	}
+	out += '\n';
+	return out;
+}
+
+struct Reply {
+	std::vector<std::string> lines;
+	std::string timing;
+	double queued = 0.0;
+	double decoded = 0.0;
+	double batch = 0.0;
+};
+
+// a reply to a request of words words: the tagged lines followed by the
+// timing line, or just an error line. The "#" line is the last one before the
+// empty line, a tagged word may start with '#' as well. False if the
+// connection ended or the reply does not have that shape.
+bool readReply(LineReader& reader, size_t words, Reply& reply) {
+	reply = Reply{};
+	for (auto line = std::string{}; reader.getline(line);) {
+		if (!line.empty()) {
+			reply.lines.push_back(line);
+			continue;
+		}
+		if (reply.lines.empty() || reply.lines.back()[0] != '#') return false;
+		reply.timing = std::move(reply.lines.back());
+		reply.lines.pop_back();
+		if (reply.lines.size() != words && !reply.lines.empty()) return false;
+
+		auto in = std::istringstream{reply.timing.substr(1)};
+		for (auto field = std::string{}; in >> field;) {
+			const auto eq = field.find('=');
+			if (eq == std::string::npos) continue;
+			const auto key = field.substr(0, eq);
+			const auto value = std::atof(field.c_str() + eq + 1);
+			if (key == "queue_us") reply.queued = value;
+			if (key == "decode_us") reply.decoded = value;
+			if (key == "batch") reply.batch = value;
+		}
+		return true;
+	}
+	return false;
+}
+
+int interactive(const Arguments& args) {
+	const auto server = Socket::connect(args.socket);
+	auto reader = LineReader{server};
+	auto reply = Reply{};
+	for (const auto& ws : readSentences(std::cin)) {
+		if (!server.writeAll(request(ws)) ||
+			!readReply(reader, ws.size(), reply)) {
+			std::cerr << "connection closed by server or malformed reply\n";
+			return 1;
+		}
+		for (const auto& line : reply.lines) {
+			std::cout << line << "\n";
+		}
+		std::cout << "\n";
+		std::cerr << reply.timing << "\n";
+	}
+	return 0;
+}
+
+struct Stats {
+	std::vector<double> latencies;	// microseconds, client side
+	double queued = 0.0;
+	double decoded = 0.0;
+	double batch = 0.0;
+	size_t words = 0;
+	bool failed = false;
+};
+
+void generate(const Arguments& args,
+			  const std::vector<std::vector<std::string>>& sentences,
+			  const std::vector<std::string>& requests, int offset,
+			  clock_type::time_point until, Stats& stats) {
+	try {
+		const auto server = Socket::connect(args.socket);
+		auto reader = LineReader{server};
+		auto reply = Reply{};
+		for (size_t i = offset; clock_type::now() < until; ++i) {
+			const auto k = i % requests.size();
+			const auto before = clock_type::now();
+			if (!server.writeAll(requests[k]) ||
+				!readReply(reader, sentences[k].size(), reply)) {
+				stats.failed = true;
+				return;
+			}
+			stats.latencies.push_back(
+				std::chrono::duration<double, std::micro>(clock_type::now() -
+														  before)
+					.count());
+			stats.queued += reply.queued;
+			stats.decoded += reply.decoded;
+			stats.batch += reply.batch;
+			stats.words += sentences[k].size();
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << "\n";
+		stats.failed = true;
+	}
+}
+
+int load(const Arguments& args) {
+	const auto sentences = readSentences(std::cin);
+	if (sentences.empty()) {
+		std::cerr << "no sentences on stdin\n";
+		return 1;
+	}
+	auto requests = std::vector<std::string>{};
+	for (const auto& ws : sentences) {
+		requests.push_back(request(ws));
+	}
+
+	auto stats = std::vector<Stats>(args.connections);
+	auto threads = std::vector<std::thread>{};
+	const auto started = clock_type::now();
+	const auto until =
+		started + std::chrono::duration_cast<clock_type::duration>(
+					  std::chrono::duration<double>(args.seconds));
+	for (int c = 0; c < args.connections; ++c) {
+		threads.emplace_back(
+			generate, std::cref(args), std::cref(sentences), std::cref(requests),
+			(c * sentences.size()) / args.connections, until,
+			std::ref(stats[c]));
+	}
+	for (auto& t : threads) {
+		t.join();
+	}
+	const auto elapsed =
+		std::chrono::duration<double>(clock_type::now() - started).count();
+
+	auto all = Stats{};
+	for (const auto& s : stats) {
+		all.latencies.insert(all.latencies.end(), s.latencies.cbegin(),
+							 s.latencies.cend());
+		all.queued += s.queued;
+		all.decoded += s.decoded;
+		all.batch += s.batch;
+		all.words += s.words;
+		all.failed = all.failed || s.failed;
+	}
+	const auto n = all.latencies.size();
+	if (n == 0) {
+		std::cerr << "no request completed\n";
+		return 1;
+	}
+	std::sort(all.latencies.begin(), all.latencies.end());
+	const auto percentile = [&](double p) {
+		return all.latencies[std::min(n - 1, static_cast<size_t>(p * n))];
+	};
+
+	std::cout << "connections     " << args.connections << "\n"
+			  << "sentences       " << n << "\n"
+			  << "sentences/s     " << n / elapsed << "\n"
+			  << "words/s         " << all.words / elapsed << "\n"
+			  << "latency p50 us  " << percentile(0.5) << "\n"
+			  << "latency p90 us  " << percentile(0.9) << "\n"
+			  << "latency p99 us  " << percentile(0.99) << "\n"
+			  << "latency max us  " << all.latencies.back() << "\n"
+			  << "mean queue us   " << all.queued / n << "\n"
+			  << "mean decode us  " << all.decoded / n << "\n"
+			  << "mean batch      " << all.batch / n << "\n";
+	return all.failed ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+	auto args = Arguments{};
+	if (!parseArguments(argc, argv, args)) {
+		return 1;
+	}
+
+	try {
+		return args.connections > 0 ? load(args) : interactive(args);
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+}
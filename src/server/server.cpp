@@ -0,0 +1,195 @@
+
+
+#include "viterbi.hpp"
+#include "HMM.hpp"
+#include "MicroBatcher.hpp"
+#include "server/Socket.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Keeps a trained model in memory and decodes the sentences of any number of
+// clients connected to a Unix domain socket. Sentences from all connections
+// are merged into micro-batches (see MicroBatcher.hpp); the protocol is
+// described in server/Socket.hpp.
+
+using Hmm_type = HMM<Viterbi<double>>;
+using Batcher_type = MicroBatcher<Hmm_type::Viterbi_type>;
+
+struct Arguments {
+	std::string socket = "paraterbi.sock";
+	std::string corpus = "../data/corpus.txt";
+	short threads = DefaultOptions::AutoDetermineChildThreads;
+	size_t maxBatch = 64;
+	long maxWait = 500;	 // microseconds
+};
+
+bool parseArguments(int argc, char** argv, Arguments& args) {
+	for (int i = 1; i < argc; ++i) {
+		const auto arg = std::string{argv[i]};
+		// false once the value of a numeric flag does not parse
+		auto valid = true;
+		if (arg == "--socket" && i + 1 < argc) {
+			args.socket = argv[++i];
+		} else if (arg == "--corpus" && i + 1 < argc) {
+			args.corpus = argv[++i];
+		} else if (arg == "--threads" && i + 1 < argc) {
+			valid = parseNumber(argv[++i], args.threads);
+		} else if (arg == "--max-batch" && i + 1 < argc) {
+			auto maxBatch = 0;
+			valid = parseNumber(argv[++i], maxBatch);
+			args.maxBatch = std::max(1, maxBatch);
+		} else if (arg == "--max-wait-us" && i + 1 < argc) {
+			valid = parseNumber(argv[++i], args.maxWait);
+			args.maxWait = std::max(0l, args.maxWait);
+		} else {
+			valid = false;
+		}
+		if (!valid) {
+			if (argv[i] != arg) {
+				std::cerr << "invalid value for " << arg << ": " << argv[i]
+						  << "\n";
+			}
+			std::cerr << "usage: " << argv[0]
+					  << " [--socket PATH] [--corpus FILE] [--threads N]"
+						 " [--max-batch N] [--max-wait-us N]\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+namespace {
+
+std::atomic<int> listening{-1};
+// set by onSignal, the accept loop ends on nothing else
+std::atomic<bool> stopping{false};
+
+extern "C" void onSignal(int) {
+	// wakes up the accept loop; shutdown is async-signal-safe
+	stopping = true;
+	const auto fd = listening.load();
+	if (fd >= 0) ::shutdown(fd, SHUT_RDWR);
+}
+
+// open client connections, so that they can be closed on shutdown. Their
+// threads are detached and only counted, a daemon must not accumulate them.
+class Connections {
+public:
+	void add(int fd) {
+		auto lock = std::lock_guard<std::mutex>{m_mutex};
+		m_fds.push_back(fd);
+	}
+
+	void remove(int fd) {
+		// notified under the lock: closeAll may destroy us right after
+		auto lock = std::lock_guard<std::mutex>{m_mutex};
+		m_fds.erase(std::remove(m_fds.begin(), m_fds.end(), fd), m_fds.end());
+		m_closed.notify_all();
+	}
+
+	void closeAll() {
+		auto lock = std::unique_lock<std::mutex>{m_mutex};
+		for (auto fd : m_fds) ::shutdown(fd, SHUT_RDWR);
+		m_closed.wait(lock, [this]() { return m_fds.empty(); });
+	}
+
+private:
+	std::mutex m_mutex;
+	std::condition_variable m_closed;
+	std::vector<int> m_fds;
+};
+
+void serve(Socket client, const Hmm_type& hmm, Batcher_type& batcher,
+		   Connections& connections) {
+	auto reader = LineReader{client};
+	auto ws = std::vector<std::string>{};
+	auto out = std::ostringstream{};
+
+	while (reader.getSentence(ws)) {
+		const auto received = Batcher_type::clock::now();
+		try {
+			auto result = batcher.submit(hmm.toEmissions(ws)).get();
+			const auto tags = hmm.toLabels(result.labels);
+
+			for (size_t i = 0; i < ws.size(); ++i) {
+				out << ws[i] << "\t" << tags[i] << "\n";
+			}
+			const auto total = std::chrono::duration<double, std::micro>(
+								   Batcher_type::clock::now() - received)
+								   .count();
+			out << "# queue_us=" << result.timing.queued
+				<< " decode_us=" << result.timing.decoded
+				<< " batch=" << result.timing.batch << " total_us=" << total
+				<< "\n\n";
+		} catch (const std::exception& e) {
+			out << "# error=" << e.what() << "\n\n";
+		}
+		if (!client.writeAll(out.str())) break;
+		out.str("");
+	}
+	connections.remove(client.fd());
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+	auto args = Arguments{};
+	if (!parseArguments(argc, argv, args)) {
+		return 1;
+	}
+
+	try {
+		// the HMM's own decoder only serves lookups, decoding happens in the
+		// batcher's decoder
+		const auto hmm = Hmm_type{args.corpus, short{0}};
+		auto batcher =
+			Batcher_type{Hmm_type::Viterbi_type{hmm.modelSlot(), args.threads},
+						 args.maxBatch, std::chrono::microseconds{args.maxWait}};
+		auto connections = Connections{};
+
+		const auto server = Socket::listen(args.socket);
+		listening = server.fd();
+		std::signal(SIGINT, onSignal);
+		std::signal(SIGTERM, onSignal);
+		std::cerr << "Listening on " << args.socket << "\n";
+
+		while (!stopping) {
+			auto client = server.accept();
+			if (client.fd() < 0) {
+				// out of descriptors or buffers, or an aborted connection:
+				// none of these ends the daemon, only a signal does
+				const auto error = errno;
+				if (stopping) break;
+				std::cerr << "accept: " << std::strerror(error) << "\n";
+				std::this_thread::sleep_for(std::chrono::milliseconds{100});
+				continue;
+			}
+			// registered here, so that closeAll cannot miss it
+			connections.add(client.fd());
+			std::thread{serve, std::move(client), std::cref(hmm),
+						std::ref(batcher), std::ref(connections)}
+				.detach();
+		}
+
+		listening = -1;
+		connections.closeAll();
+		::unlink(args.socket.c_str());
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
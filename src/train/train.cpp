@@ -0,0 +1,177 @@
+
+
+#include "viterbi.hpp"
+#include "BaumWelch.hpp"
+#include "HMM.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Refines a model with Baum-Welch iterations over untagged sentences (one
+// word per line, an empty line after every sentence, like paraterbi reads
+// them). The initial model is trained from a tagged corpus or loaded from a
+// checkpoint; every iteration is saved to <checkpoint>.<iteration>, which
+// paraterbi --model and --resume read.
+
+using Hmm_type = HMM<Viterbi<double>>;
+using BaumWelch_type = BaumWelch<Hmm_type::Viterbi_type>;
+using Emission_type = Hmm_type::Emission_type;
+
+struct Arguments {
+	std::string corpus = "../data/corpus.txt";
+	std::string resume;
+	std::string raw;
+	std::string checkpoint = "paraterbi-model";
+	int iterations = 5;
+	short threads = std::max(1u, std::thread::hardware_concurrency());
+	double smoothing = 1e-3;
+	size_t block = 4096;
+};
+
+bool parseArguments(int argc, char** argv, Arguments& args) {
+	for (int i = 1; i < argc; ++i) {
+		const auto arg = std::string{argv[i]};
+		// false once the value of a numeric flag does not parse
+		auto valid = true;
+		if (arg == "--corpus" && i + 1 < argc) {
+			args.corpus = argv[++i];
+		} else if (arg == "--resume" && i + 1 < argc) {
+			args.resume = argv[++i];
+		} else if (arg == "--raw" && i + 1 < argc) {
+			args.raw = argv[++i];
+		} else if (arg == "--checkpoint" && i + 1 < argc) {
+			args.checkpoint = argv[++i];
+		} else if (arg == "--iterations" && i + 1 < argc) {
+			valid = parseNumber(argv[++i], args.iterations);
+			args.iterations = std::max(0, args.iterations);
+		} else if (arg == "--threads" && i + 1 < argc) {
+			valid = parseNumber(argv[++i], args.threads);
+			args.threads = std::max<short>(1, args.threads);
+		} else if (arg == "--smoothing" && i + 1 < argc) {
+			valid = parseNumber(argv[++i], args.smoothing);
+			args.smoothing = std::min(1.0, std::max(0.0, args.smoothing));
+		} else if (arg == "--block" && i + 1 < argc) {
+			auto block = 0;
+			valid = parseNumber(argv[++i], block);
+			args.block = std::max(1, block);
+		} else {
+			valid = false;
+		}
+		if (!valid) {
+			if (argv[i] != arg) {
+				std::cerr << "invalid value for " << arg << ": " << argv[i]
+						  << "\n";
+			}
+			std::cerr << "usage: " << argv[0]
+					  << " --raw FILE [--corpus FILE | --resume CHECKPOINT]"
+						 " [--checkpoint PREFIX] [--iterations N]"
+						 " [--threads N] [--smoothing P] [--block N]\n";
+			return false;
+		}
+	}
+	if (args.raw.empty()) {
+		std::cerr << "--raw is required\n";
+		return false;
+	}
+	return true;
+}
+
+// iterations of a run resumed from <prefix>.<n> are numbered from n + 1, so
+// that its checkpoints follow the earlier ones instead of overwriting them.
+// False if resume does not end in such an iteration number.
+bool firstIteration(const Arguments& args, int& first) {
+	first = 1;
+	if (args.resume.empty()) return true;
+	const auto dot = args.resume.rfind('.');
+	if (dot == std::string::npos) return false;
+	const auto suffix = args.resume.substr(dot + 1);
+	auto n = 0;
+	if (suffix.empty() ||
+		suffix.find_first_not_of("0123456789") != std::string::npos ||
+		!parseNumber(suffix, n) ||
+		n >= std::numeric_limits<int>::max() - args.iterations) {
+		return false;
+	}
+	first = n + 1;
+	return true;
+}
+
+int main(int argc, char** argv) {
+	auto args = Arguments{};
+	if (!parseArguments(argc, argv, args)) {
+		return 1;
+	}
+	auto first = 1;
+	if (!firstIteration(args, first)) {
+		std::cerr << "--resume expects a checkpoint <prefix>.<iteration>, not "
+				  << args.resume << "\n";
+		return 1;
+	}
+
+	try {
+		auto saved = std::ifstream{args.resume};
+		// only used to map words and to publish models, decodes nothing
+		auto hmm = args.resume.empty() ? Hmm_type{args.corpus, short{0}}
+									   : Hmm_type{saved, short{0}};
+		auto trainer = BaumWelch_type{args.threads, args.smoothing};
+
+		for (int iteration = first; iteration < first + args.iterations;
+			 ++iteration) {
+			auto raw = std::ifstream{args.raw};
+			if (!raw) {
+				std::cerr << "Could not read " << args.raw << "\n";
+				return 1;
+			}
+			// words the model does not know are read as emission 0, like
+			// when decoding, just without complaining about each of them
+			auto line = std::string{};
+			auto ts = std::vector<Emission_type>{};
+			const auto nextBlock = [&](BaumWelch_type::Sentences_type& block) {
+				while (block.size() < args.block && std::getline(raw, line)) {
+					if (line.empty()) {
+						block.push_back(ts);
+						ts.clear();
+					} else {
+						ts.push_back(
+							std::max<Emission_type>(0, hmm.emissionId(line)));
+					}
+				}
+				return block.size() == args.block;
+			};
+
+			const auto before = std::chrono::steady_clock::now();
+			auto statistics = BaumWelch_type::Statistics{};
+			hmm.setModel(trainer.iterate(*hmm.model(), nextBlock, statistics));
+			const auto seconds = std::chrono::duration<double>(
+									 std::chrono::steady_clock::now() - before)
+									 .count();
+
+			const auto file = args.checkpoint + "." + std::to_string(iteration);
+			auto out = std::ofstream{file};
+			hmm.save(out);
+			if (!out) {
+				std::cerr << "Could not write " << file << "\n";
+				return 1;
+			}
+
+			std::cerr << "iteration " << iteration << ": log likelihood "
+					  << statistics.logLikelihood << " ("
+					  << statistics.logLikelihood /
+							 std::max<size_t>(1, statistics.words)
+					  << " per word), " << statistics.sentences
+					  << " sentences, " << statistics.skipped << " skipped, "
+					  << seconds << " s -> " << file << "\n";
+		}
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}
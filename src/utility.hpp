@@ -4,6 +4,10 @@
 #define __UTILITY_HPP__
 #include <string>
 #include <iostream>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
 
 template<typename container_T>
 void showAll(const std::string& name, const container_T& v) {
@@ -14,4 +18,41 @@ void showAll(const std::string& name, const container_T& v) {
 	std::cout << std::endl;
 }
 
+// busy waits for done() to become true, but gives the core away once a wait
+// gets long so that an oversubscribed machine still makes progress
+template <typename predicate_T>
+inline void spinUntil(predicate_T done) {
+	for (int spins = 0; !done(); ++spins) {
+		if (spins > 4096) {
+			std::this_thread::yield();
+		}
+	}
+}
+
+// parses all of text as a number of value's type into value; false (and
+// value untouched) for anything else, including numbers out of its range
+template <typename number_T>
+inline bool parseNumber(const std::string& text, number_T& value) {
+	auto end = size_t{0};
+	try {
+		if constexpr (std::is_floating_point<number_T>::value) {
+			const auto v = std::stod(text, &end);
+			if (end != text.size()) return false;
+			value = v;
+		} else {
+			using limits = std::numeric_limits<number_T>;
+			const auto v = std::stoll(text, &end);
+			if (end != text.size() || v < static_cast<long long>(limits::min()) ||
+				v > static_cast<long long>(limits::max())) {
+				return false;
+			}
+			value = static_cast<number_T>(v);
+		}
+	} catch (const std::logic_error&) {
+		// std::invalid_argument, std::out_of_range
+		return false;
+	}
+	return true;
+}
+
 #endif
@@ -1,14 +1,19 @@
-
-
 #ifndef PARATERBI__VITERBI_HPP__
 #define PARATERBI__VITERBI_HPP__
 
 #include "MatrixV.hpp"
+#include "PerfCounters.hpp"
+#include "Topology.hpp"
+#include "Trace.hpp"
 #include "utility.hpp"
 #include <iostream>
 
 #include <limits>
 #include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
 #include <vector>
 #include <thread>
 #include <atomic>
@@ -31,6 +36,16 @@ public:
 	using Matrix_type = MatrixV<floatv>;
 	using Viterbi_type = Viterbi<Probability_type, options>;
 
+	// banded topology: label `to` can only follow the labels
+	// [to - back, to + ahead], e.g. {width - 1, 0} for left-to-right models
+	// where every state is reached from itself and a few predecessors
+	struct Band {
+		int back;
+		int ahead;
+
+		inline int width() const { return back + ahead + 1; }
+	};
+
 	struct Model {
 	public:
 		using Label_type = Viterbi_type::Label_type;
@@ -45,16 +60,38 @@ public:
 		Model(int labels, int emissions, Probability_type defaultValue)
 			: start(labels, 1, defaultValue),
 			  transitions(labels, labels, defaultValue),
-			  emissions(labels, emissions, defaultValue) {}
+			  emissions(labels, emissions, defaultValue),
+			  diagonals(labels, 0, defaultValue),
+			  band{-1, -1} {}
+
+		// stores only the transitions within the band, labels * width
+		// instead of labels^2, and decodes a column in O(labels * width)
+		Model(int labels, int emissions, Probability_type defaultValue,
+			  Band b)
+			: start(labels, 1, defaultValue),
+			  transitions(labels, 0, defaultValue),
+			  emissions(labels, emissions, defaultValue),
+			  diagonals(labels, clamped(b).width(), defaultValue),
+			  band(clamped(b)) {}
+
+		Model(const Model& other) = default;
+		Model(Model&& other) = default;
+		Model& operator=(const Model& rhs) = default;
+		Model& operator=(Model&& rhs) = default;
 
 	public:
 		inline void setStart(Label_type i, Probability_type value) {
 			start(i, 0) = value;
 		}
 
+		// transitions outside the band of a banded model stay impossible
 		inline void setTransition(Label_type from, Label_type to,
 								  Probability_type value) {
-			transitions(to, from) = value;
+			if (!banded()) {
+				transitions(to, from) = value;
+			} else if (inBand(from, to)) {
+				diagonals(to, diagonal(from, to)) = value;
+			}
 		}
 
 		inline void setEmission(Label_type label, Emission_type emission,
@@ -62,90 +99,345 @@ public:
 			emissions(label, emission) = value;
 		}
 
+		inline Probability_type getStart(Label_type i) const {
+			return start(i, 0);
+		}
+
+		inline Probability_type getTransition(Label_type from,
+											  Label_type to) const {
+			if (!banded()) {
+				return transitions(to, from);
+			}
+			return inBand(from, to)
+					   ? diagonals(to, diagonal(from, to))
+					   : -std::numeric_limits<Probability_type>::infinity();
+		}
+
+		inline bool banded() const { return band.back >= 0; }
+		inline const Band& getBand() const { return band; }
+
+		// the same model restricted to a band, transitions outside it are
+		// dropped
+		Model withBand(Band b) const {
+			auto m = Model{labelCount(), emissionCount(),
+						   -std::numeric_limits<Probability_type>::infinity(),
+						   b};
+			m.start = start;
+			m.emissions = emissions;
+			for (int to = 0; to < labelCount(); ++to) {
+				const auto first = std::max(0, to - m.band.back);
+				const auto last = std::min(labelCount() - 1, to + m.band.ahead);
+				for (int from = first; from <= last; ++from) {
+					m.setTransition(from, to, getTransition(from, to));
+				}
+			}
+			return m;
+		}
+
+		inline Probability_type getEmission(Label_type label,
+											Emission_type emission) const {
+			return emissions(label, emission);
+		}
+
+		inline int labelCount() const { return start.rows(); }
+		inline int labelVectorCount() const {
+			return start.vectorsCountPerColumn();
+		}
+		inline int emissionCount() const { return emissions.columns(); }
+
+	private:
+		// negative extents mean none
+		static inline Band clamped(Band b) {
+			return Band{std::max(0, b.back), std::max(0, b.ahead)};
+		}
+
+		inline bool inBand(Label_type from, Label_type to) const {
+			return from >= to - band.back && from <= to + band.ahead;
+		}
+
+		// column of diagonals holding the transition from -> to
+		inline int diagonal(Label_type from, Label_type to) const {
+			return from - to + band.back;
+		}
+
 	private:
 		Matrix_type start;
+		// (to, from), no columns if banded
 		Matrix_type transitions;
 		Matrix_type emissions;
+		// banded only: (to, d) holds the transition from to - back + d
+		Matrix_type diagonals;
+		Band band;
 	};  // end class Model
 
+	// a trained model is never modified again, so any number of decoders
+	// (and their worker threads) may read the same instance
+	using ModelPtr = std::shared_ptr<const Model>;
+
+	// where decoders find the current model, shared by copies of a decoder.
+	// Updates are published by swapping the pointer (RCU style): every call
+	// to infer takes the model current at its start and keeps it alive until
+	// it returns, so neither decoding nor publishing ever waits for the other.
+	class ModelSlot {
+	public:
+		explicit ModelSlot(ModelPtr m) : m_model(std::move(m)) {}
+
+		ModelSlot(const ModelSlot& other) = delete;
+		ModelSlot& operator=(const ModelSlot& rhs) = delete;
+
+		inline ModelPtr load() const { return std::atomic_load(&m_model); }
+		inline void publish(ModelPtr m) {
+			std::atomic_store(&m_model, std::move(m));
+		}
+
+	private:
+		ModelPtr m_model;
+	};  // end class ModelSlot
+
+	using ModelSlotPtr = std::shared_ptr<ModelSlot>;
+
+	// how a decoder spreads its work, determined once at construction
+	struct Strategy {
+		// threads besides the one calling infer
+		short threads;
+		// threads (including the caller) sharing the label vectors of one
+		// column; 1 means the plain sequential SIMD loop
+		short columnWorkers;
+		// measured seconds per column, alone and with columnWorkers threads
+		double sequentialColumn;
+		double parallelColumn;
+	};
+
+	// what decoding batches as prefix tries saved, summed over all of them
+	struct PrefixStatistics {
+		long sentences = 0;
+		// distinct prefixes, i.e. columns computed
+		long columns = 0;
+		// columns decoding every sentence on its own would have computed
+		long naiveColumns = 0;
+		long cellsSaved = 0;
+	};
+
 public:
 	// constructors
 	Viterbi() = delete;
+	// decodes whatever model is published to the slot
+	Viterbi(ModelSlotPtr slot,
+			short childThreads = options::AutoDetermineChildThreads,
+			Placement placement = Placement::Unpinned)
+		: m_slot(std::move(slot)),
+		  m_context(std::make_unique<Context>(m_slot->load(), childThreads,
+											  placement)) {}
+
+	Viterbi(ModelPtr m,
+			short childThreads = options::AutoDetermineChildThreads,
+			Placement placement = Placement::Unpinned)
+		: Viterbi(std::make_shared<ModelSlot>(std::move(m)), childThreads,
+				  placement) {}
+
 	Viterbi(const Model& m,
-			short childThreads = options::AutoDetermineChildThreads)
-		: m_model(m),
-		  trellis(m.start.rows(), 8,
-				  -(std::numeric_limits<Probability_type>::infinity())),
-		  backpointers(m.start.rows(), 8, 0),
-		  m_tsStackPtr(nullptr),
-		  m_spawn(*this, childThreads) {}
+			short childThreads = options::AutoDetermineChildThreads,
+			Placement placement = Placement::Unpinned)
+		: Viterbi(std::make_shared<const Model>(m), childThreads, placement) {}
 
+	Viterbi(Model&& m, short childThreads = options::AutoDetermineChildThreads,
+			Placement placement = Placement::Unpinned)
+		: Viterbi(std::make_shared<const Model>(std::move(m)), childThreads,
+				  placement) {}
+
+	// a copy shares the model slot (and the NUMA replicas) and the
+	// calibrated strategy, but gets its own trellis and worker threads
 	Viterbi(const Viterbi_type& other)
-		: m_model(other.m_model),
-		  trellis(other.trellis),
-		  backpointers(other.backpointers),
-		  m_tsStackPtr(nullptr),
-		  m_spawn(*this, other.m_spawn.m_workers) {}
+		: m_slot(other.m_slot),
+		  m_context(std::make_unique<Context>(*other.m_context)) {}
+
+	Viterbi(Viterbi_type&& other) noexcept = default;
 
 	Viterbi_type& operator=(const Viterbi_type& rhs) {
-		m_model = rhs.m_model;
-		trellis = rhs.trellis;
-		backpointers = rhs.backpointers;
-		m_tsStackPtr = nullptr;
-		m_spawn.m_workersDone = 0;
-		m_spawn.m_targetColumn = -1;  // signal for workers to die
-		while (m_spawn.m_workersDone > -m_spawn.M_workers) {
-			// sleep
-		}
-		// all workers are now dead
-		m_spawn.m_targetColumn = 0;
-		m_spawn.m_workers = m_spawn.spawn(*this, rhs.m_workers);
-		m_spawn.m_workersDone = m_spawn.m_workers;
+		if (this != &rhs) {
+			*this = Viterbi_type{rhs};
+		}
+		return *this;
 	}
 
-	~Viterbi() {
-				m_spawn.m_targetColumn = -1;  // signal for workers to die
-		while (m_spawn.m_workersDone > -m_spawn.m_workers) {
-			// sleep
-		}
-		// all workers are now dead
+	Viterbi_type& operator=(Viterbi_type&& rhs) noexcept = default;
+
+	~Viterbi() = default;
+
+	inline ModelPtr model() const { return m_slot->load(); }
+	inline const ModelSlotPtr& slot() const { return m_slot; }
+	inline const Strategy& strategy() const { return m_context->strategy(); }
+	inline int labelCount() const { return model()->labelCount(); }
+	inline int labelVectorCount() const { return model()->labelVectorCount(); }
+
+	// replaces the model of this decoder and of all decoders sharing its
+	// slot; calls already running finish with the old one
+	inline void publish(ModelPtr m) { m_slot->publish(std::move(m)); }
+
+	// makes inferBatch arrange its sentences as a trie and compute the
+	// column of every distinct prefix once, for batches of sentences that
+	// share long prefixes (form fields, log templates)
+	inline void setPrefixSharing(bool share) {
+		m_context->setPrefixSharing(share);
 	}
+	inline const PrefixStatistics& prefixStatistics() const {
+		return m_context->prefixStatistics();
+	}
+
+	std::vector<Label_type> infer(const std::vector<Emission_type>& ts) {
+		const auto m = m_slot->load();
+		m_context->adopt(m);
+		return m_context->infer(*m, ts);
+	}  // end infer
 
-	inline int labelCount() const { return m_model.start.rows(); }
-	inline int labelVectorCount() const {
-		return m_model.start.vectorsCountPerColumn();
+	// decodes independent sentences, either one after the other with each
+	// column split among threads or one sentence per thread, whichever the
+	// calibration predicts to finish first
+	std::vector<std::vector<Label_type>> inferBatch(
+		const std::vector<std::vector<Emission_type>>& batch) {
+		const auto m = m_slot->load();
+		m_context->adopt(m);
+		return m_context->inferBatch(*m, batch);
 	}
 
-	std::vector<Label_type> infer(std::vector<Emission_type> ts) {
-		const int n = ts.size();
-		if (n == 0) return std::vector<Label_type>{};
+private:
+	using IndexMatrix_type = MatrixV<typename floatv::IndexType>;
 
-		const int labelCount = this->labelCount();
-		const int labelVectorsCount = this->labelVectorCount();
+	// trellis and backpointers of a single sentence
+	struct Scratch {
+		explicit Scratch(int labels)
+			: trellis(labels, 8,
+					  -(std::numeric_limits<Probability_type>::infinity())),
+			  backpointers(labels, 8, 0) {}
+
+		inline void reserve(int n) {
+			trellis.reserve(n);
+			backpointers.reserve(n);
+		}
+
+		Matrix_type trellis;
+		IndexMatrix_type backpointers;
+	};
+
+	// emission ids of a vocabulary newer than the model read as 0, the id
+	// unknown words get
+	static inline Emission_type known(const Model& model, Emission_type e) {
+		return e < model.emissionCount() ? e : 0;
+	}
+
+	static inline void firstColumn(const Model& model, Scratch& s,
+								   Emission_type e, const int j = 0) {
+		VITERBI_PERF_SCOPE(FirstColumn, model.labelCount());
+		VITERBI_TRACE_SPAN(FirstColumn, j);
+		e = known(model, e);
+		for (auto i = 0; i < model.labelVectorCount(); ++i) {
+			const floatv st = model.start.vector(i, 0);
+			const floatv em = model.emissions.vector(i, e);
+			s.trellis.vector(i, j) = em + st;
+		}
+	}
 
-		trellis.reserve(n);
-		backpointers.reserve(n);
+	// computes the label vectors [begin, end) of column j
+	static inline void computeColumn(const Model& model, Scratch& s,
+									 const int j, Emission_type e,
+									 const int begin, const int end) {
+		computeColumn(model, s, j, j - 1, e, begin, end);
+	}
 
-		// first column
-		for (auto i = 0; i < labelVectorsCount; ++i) {
-			const floatv s = m_model.start.vector(i, 0);
-			const floatv em = m_model.emissions.vector(i, ts[0]);
-			trellis.vector(i, 0) = em + s;
+	// the same, following column `from` instead of j - 1
+	static inline void computeColumn(const Model& model, Scratch& s,
+									 const int j, const int from,
+									 Emission_type e, const int begin,
+									 const int end) {
+		if (model.banded()) {
+			computeBandedColumn(model, s, j, from, e, begin, end);
+			return;
 		}
+		const int labelCount = model.labelCount();
+		e = known(model, e);
+		auto& trellis = s.trellis;
+
+		for (int i = begin; i < end; ++i) {
+			auto winner = typename floatv::IndexType{0};
+			auto winnerProb =
+				floatv(-(std::numeric_limits<Probability_type>::infinity()));
+			const auto emProb = floatv{model.emissions.vector(i, e)};
+			for (int prev = 0; prev < labelCount; ++prev) {
+				const auto p = trellis(prev, from);
+				const auto t = floatv{model.transitions.vector(i, prev)};
+				const auto candidate = p + t;
+				const auto mask = winnerProb < candidate;
+
+				winner =
+					Vc::iif(mask, typename floatv::IndexType(prev), winner);
+				winnerProb = Vc::iif(mask, candidate, winnerProb);
+			}
+			trellis.vector(i, j) = winnerProb + emProb;
+			s.backpointers.vector(i, j) = winner;
+		}  // end outer for
+	}
+
+	// computeColumn for banded models: the scores of the predecessors of
+	// the labels in vector i at diagonal d are those of the previous column
+	// shifted by d - back rows, which one unaligned load fetches. Candidates
+	// are taken in the order of their previous label, like computeColumn
+	// does, so ties resolve to the same paths.
+	static inline void computeBandedColumn(const Model& model, Scratch& s,
+										   const int j, const int from,
+										   Emission_type e, const int begin,
+										   const int end) {
+		using IndexType = typename floatv::IndexType;
+		const int labelCount = model.labelCount();
+		const int lanes = floatv::Size;
+		const auto& band = model.band;
+		const auto fromZero = IndexType::IndexesFromZero();
+		e = known(model, e);
+		auto& trellis = s.trellis;
+
+		for (int i = begin; i < end; ++i) {
+			auto winner = IndexType{0};
+			auto winnerProb =
+				floatv(-(std::numeric_limits<Probability_type>::infinity()));
+			const auto emProb = floatv{model.emissions.vector(i, e)};
+			for (int d = 0; d < band.width(); ++d) {
+				// previous label of lane 0
+				const int first = i * lanes - band.back + d;
+				const auto p = shifted(trellis, from, first, labelCount);
+				const auto t = floatv{model.diagonals.vector(i, d)};
+				const auto candidate = p + t;
+				const auto mask = winnerProb < candidate;
 
-		// other columns
-		m_tsStackPtr = ts.data();
+				winner = Vc::iif(mask, fromZero + IndexType(first), winner);
+				winnerProb = Vc::iif(mask, candidate, winnerProb);
+			}
+			trellis.vector(i, j) = winnerProb + emProb;
+			s.backpointers.vector(i, j) = winner;
+		}
+	}
 
-		for(int i = 1; i < n; ++i) {
-			m_spawn.m_workersDone = 0;
-			++m_tsStackPtr;
-//			std::cerr << i << std::endl;
-			m_spawn.m_targetColumn = i;
-			while(m_spawn.m_workersDone != m_spawn.m_workers) {}
+	// rows [first, first + lanes) of a trellis column, -inf outside the
+	// labels
+	static inline floatv shifted(const Matrix_type& trellis, const int column,
+								 const int first, const int labelCount) {
+		const int lanes = floatv::Size;
+		if (first >= 0 && first + lanes <= labelCount) {
+			return floatv(&trellis(first, column), Vc::Unaligned);
+		}
+		auto p = floatv(-(std::numeric_limits<Probability_type>::infinity()));
+		for (int k = std::max(0, -first);
+			 k < std::min(lanes, labelCount - first); ++k) {
+			p[k] = trellis(first + k, column);
 		}
-		m_spawn.m_workersDone = 0;
-//		m_spawn.m_targetColumn = 0;
-//		m_spawn.m_workersDone = 0;
+		return p;
+	}
+
+	static inline std::vector<Label_type> backtrace(const Model& model,
+													const Scratch& s,
+													const int n) {
+		VITERBI_PERF_SCOPE(Backtrace, n);
+		VITERBI_TRACE_SPAN(Backtrace, n);
+		const int labelCount = model.labelCount();
+		const auto& trellis = s.trellis;
 
 		// check last column separately for highest likelihood
 		const auto maxIndex = std::distance(
@@ -156,114 +448,846 @@ public:
 		// now retrace the backpointers to find the best label sequence
 		auto best = std::vector<Label_type>(n, maxIndex);
 		for (auto j = n - 1; j > 0; --j) {
-			best[j - 1] = backpointers(best[j], j);
+			best[j - 1] = s.backpointers(best[j], j);
 		}
 
 		return best;
-	}  // end infer
+	}
+
+	static std::vector<Label_type> decodeSequential(
+		const Model& model, Scratch& s, const std::vector<Emission_type>& ts) {
+		const int n = ts.size();
+		if (n == 0) return std::vector<Label_type>{};
+		VITERBI_TRACE_SPAN(Sentence, n);
+
+		s.reserve(n);
+		firstColumn(model, s, ts[0]);
+		{
+			VITERBI_PERF_SCOPE(Columns, (n - 1) * model.labelCount());
+			for (int j = 1; j < n; ++j) {
+				computeColumn(model, s, j, ts[j], 0, model.labelVectorCount());
+			}
+		}
+		return backtrace(model, s, n);
+	}
+
+	class Context;
 
-private:
 	class WorkerSpawn {
 	public:
-		static void worker(Viterbi_type& parent, const Label_type begin,
-						   const Label_type end) {
-			auto myColumn = int{0};
-			auto& pool = parent.m_spawn;
-			const int labelCount = parent.labelCount();
-
-//			std::cerr << "my range: " << begin << " : " << end << std::endl;
-			while (pool.m_targetColumn != -1) {
+		static void worker(Context& context, const int index, const int node,
+						   const bool columns) {
+			auto& pool = context.m_spawn;
+			auto seenColumn = int{0};
+			auto seenBatch = int{0};
 
-				while(myColumn == pool.m_targetColumn) {
-					// sleep
+			while (true) {
+				auto column = seenColumn;
+				auto batch = seenBatch;
+				{
+					VITERBI_TRACE_SPAN(Wait, index);
+					spinUntil([&]() {
+						column =
+							pool.m_columnRound.load(std::memory_order_acquire);
+						batch = pool.m_batchRound.load(std::memory_order_acquire);
+						return (columns && column != seenColumn) ||
+							   batch != seenBatch ||
+							   pool.m_stop.load(std::memory_order_relaxed);
+					});
 				}
 
-				if (pool.m_targetColumn == -1) {
-					--pool.m_workersDone;
+				if (pool.m_stop.load(std::memory_order_acquire)) {
 					return;
 				}
 
+				// the owner waits for every round to finish before starting
+				// the next one, so only one of them can have changed
+				if (columns && column != seenColumn) {
+					seenColumn = column;
+					context.computeColumn(context.modelOn(node), index);
+				} else {
+					seenBatch = batch;
+					context.runTask(context.modelOn(node), index);
+				}
+				pool.m_workersDone.fetch_add(1, std::memory_order_release);
+			}
+		}  // end worker
 
+	public:
+		friend Context;
 
+		WorkerSpawn()
+			: m_columnRound(0),
+			  m_batchRound(0),
+			  m_workersDone(0),
+			  m_stop(false),
+			  m_columnWorkers(1),
+			  m_column(0) {}
 
+		~WorkerSpawn() { stop(); }
 
+		// starts `threads` workers, the first columnWorkers - 1 of which
+		// also take part in computing columns. Thread i decodes whole
+		// sentences on scratch i, scratch 0 belongs to the calling thread.
+		void spawn(Context& context, short threads, short columnWorkers,
+				   Placement placement) {
+			const auto& topology = Topology::system();
+			const bool pinned = placement != Placement::Unpinned;
 
-//				myColumn = pool.m_targetColumn == 1 ? 1 : myColumn+1;
-				const int j = pool.m_targetColumn;
-				myColumn = j;
-				for (int i = begin; i < end; ++i) {
-//					std::cerr << "Current " << j << ", " << i << ", my: " << myColumn << std::endl;
-					auto winner = typename floatv::IndexType{0};
-					auto winnerProb = floatv(
-						-(std::numeric_limits<Probability_type>::infinity()));
-					const auto emProb = floatv{parent.m_model.emissions.vector(
-						i, *(parent.m_tsStackPtr))};
-					for (int prev = 0; prev < labelCount; ++prev) {
-						const auto p = parent.trellis(prev, j - 1);
-						const auto t =
-							floatv{parent.m_model.transitions.vector(i, prev)};
-						const auto candidate = p + t;
-						const auto mask = winnerProb < candidate;
+			m_columnWorkers = columnWorkers;
+			m_threads.reserve(threads);
+			for (int i = 1; i <= threads; ++i) {
+				const auto cpu = topology.cpuForWorker(i);
+				const auto node = pinned ? topology.nodeOf(cpu) : 0;
+				m_threads.emplace_back(WorkerSpawn::worker, std::ref(context),
+									   i, node, i < columnWorkers);
+				if (pinned && !Topology::pin(m_threads.back(), cpu)) {
+					std::cerr << "Could not pin worker " << i << " to cpu "
+							  << cpu << ".\n";
+				}
+			}
+		}
 
-						winner = Vc::iif(mask, typename floatv::IndexType(prev),
-										 winner);
-						winnerProb = Vc::iif(mask, candidate, winnerProb);
-					}
-					parent.trellis.vector(i, j) = winnerProb + emProb;
-					parent.backpointers.vector(i, j) = winner;
-				}  // end outer for
-				++pool.m_workersDone;
-//				std::cerr << begin << "," << end << " Done: " << pool.m_workersDone << std::endl;
+		void stop() {
+			m_stop.store(true, std::memory_order_release);
+			for (auto& t : m_threads) {
+				t.join();
 			}
-			--pool.m_workersDone;
-		}  // end worker
+			m_threads.clear();
+			m_stop = false;
+			m_columnRound = 0;
+			m_batchRound = 0;
+			m_columnWorkers = 1;
+		}
 
-	public:
-		friend Viterbi_type;
+		inline short threads() const { return m_threads.size(); }
+
+		// label vectors [begin, end) of the given column worker. The last
+		// rows are padded/might take a couple cycles more due to SIMD lanes,
+		// so if the split is uneven the last workers get fewer rows.
+		inline std::pair<int, int> range(int worker, int labelVectors) const {
+			const int k = labelVectors;
+			const int n = m_columnWorkers;
+			return {k - ((n - worker) * k) / n,
+					k - ((n - worker - 1) * k) / n};
+		}
 
-		WorkerSpawn(Viterbi_type& parent, short desiredWorkers)
-			: m_targetColumn(0),
-			  m_workers(spawn(parent, desiredWorkers)),
-			  m_workersDone(m_workers) {}
-
-		short spawn(Viterbi_type& parent, short desired) {
-			const short n = desired == options::AutoDetermineChildThreads
-								? std::thread::hardware_concurrency()
-								: desired;
-			const auto k = parent.labelVectorCount();
-			const short rowsPerChild = (k + n - 1) / n;
-//			std::cerr << rowsPerChild << " = " << k << " / " << n << std::endl;
-			for (auto i = 0; i < n - 1; ++i) {
-				auto child =
-					std::thread{WorkerSpawn::worker, std::ref(parent),
-								i * rowsPerChild, (i + 1) * rowsPerChild};
-				child.detach();
-			}
-			// this may be the only thread
-			// or the last one (handling the last rows). Since the last rows are
-			// padded/might take a couple cycles more due to SIMD lanes, the
-			// last thread gets a couple fewer rows in case of k mod n != 0
-			auto child = std::thread{WorkerSpawn::worker, std::ref(parent),
-									 (n - 1) * rowsPerChild,
-									 k};
-//									 ((n - 1) * rowsPerChild) + (k / n)};
-			child.detach();
-
-			return n;
+		inline void startColumn(int j) {
+			m_column = j;
+			m_workersDone.store(0, std::memory_order_relaxed);
+			m_columnRound.fetch_add(1, std::memory_order_release);
+		}
+
+		inline void startBatch() {
+			m_workersDone.store(0, std::memory_order_relaxed);
+			m_batchRound.fetch_add(1, std::memory_order_release);
+		}
+
+		inline void await(int workers) {
+			spinUntil([&]() {
+				return m_workersDone.load(std::memory_order_acquire) ==
+					   workers;
+			});
 		}
 
 	private:
-		std::atomic<int> m_targetColumn;
-		const short m_workers;
+		std::atomic<int> m_columnRound;
+		std::atomic<int> m_batchRound;
 		std::atomic<int> m_workersDone;
+		std::atomic<bool> m_stop;
+		short m_columnWorkers;
+		int m_column;
+		std::vector<std::thread> m_threads;
 	};  // end class WorkerSpawn
 
+	// per-decoder state: the trellises and the threads working on them. It
+	// lives on the heap so that its address (which the workers hold on to)
+	// survives moving the owning Viterbi.
+	class Context {
+	public:
+		friend WorkerSpawn;
+
+		Context(const ModelPtr& m, short childThreads, Placement placement)
+			: Context(m,
+					  Strategy{threadsFor(childThreads), 1, 0.0, 0.0},
+					  placement,
+					  placement == Placement::NumaReplicated
+						  ? replicate(m, Topology::system())
+						  : std::vector<ModelPtr>{}) {
+			m_strategy = calibrate(*m);
+			m_spawn.spawn(*this, m_strategy.threads,
+						  m_strategy.columnWorkers, m_placement);
+		}
+
+		// same configuration and replicas, fresh trellis and threads
+		Context(const Context& other)
+			: Context(other.m_current, other.m_strategy, other.m_placement,
+					  other.m_replicas) {
+			m_sharePrefixes = other.m_sharePrefixes;
+			m_spawn.spawn(*this, m_strategy.threads,
+						  m_strategy.columnWorkers, m_placement);
+		}
+
+		Context& operator=(const Context& rhs) = delete;
+
+		inline const Strategy& strategy() const { return m_strategy; }
+
+		inline void setPrefixSharing(bool share) { m_sharePrefixes = share; }
+		inline const PrefixStatistics& prefixStatistics() const {
+			return m_prefixStatistics;
+		}
+
+		// prepares for decoding with a newly published model: resizes the
+		// trellises to its labels and replicates it to the NUMA nodes. The
+		// strategy calibrated for the first model is kept unless the new one
+		// is banded differently, which changes what a column costs.
+		void adopt(const ModelPtr& m) {
+			if (m == m_current) return;
+			const auto& band = m->getBand();
+			const auto& previous = m_current->getBand();
+			const bool recalibrate =
+				band.back != previous.back || band.ahead != previous.ahead;
+			if (m->labelCount() != m_current->labelCount()) {
+				m_scratch.assign(m_scratch.size(), Scratch(m->labelCount()));
+			}
+			if (!m_replicas.empty()) {
+				m_replicas = replicate(m, Topology::system());
+			}
+			m_current = m;
+			if (recalibrate) {
+				m_spawn.stop();
+				m_strategy.columnWorkers = 1;
+				m_strategy = calibrate(*m);
+				m_spawn.spawn(*this, m_strategy.threads,
+							  m_strategy.columnWorkers, m_placement);
+			}
+		}
+
+		std::vector<Label_type> infer(const Model& model,
+									  const std::vector<Emission_type>& ts) {
+			const int n = ts.size();
+			auto& s = m_scratch.front();
+			if (timeParallel(model, n)) {
+				return inferChunked(model, ts);
+			}
+			if (m_strategy.columnWorkers == 1 || n < 2) {
+				return decodeSequential(model, s, ts);
+			}
+
+			s.reserve(n);
+			firstColumn(model, s, ts[0]);
+
+			// other columns
+			m_model = &model;
+			m_ts = ts.data();
+			const auto& own = modelOn(callerNode());
+			for (int j = 1; j < n; ++j) {
+				m_spawn.startColumn(j);
+				computeColumn(own, 0);
+				VITERBI_TRACE_SPAN(Barrier, j);
+				m_spawn.await(m_strategy.columnWorkers - 1);
+			}
+
+			return backtrace(model, s, n);
+		}  // end infer
+
+		std::vector<std::vector<Label_type>> inferBatch(
+			const Model& model,
+			const std::vector<std::vector<Emission_type>>& batch) {
+			if (m_sharePrefixes) {
+				return inferShared(model, batch);
+			}
+
+			auto results = std::vector<std::vector<Label_type>>(batch.size());
+			if (!sentenceParallel(batch)) {
+				for (size_t i = 0; i < batch.size(); ++i) {
+					results[i] = infer(model, batch[i]);
+				}
+				return results;
+			}
+
+			m_batch = &batch;
+			m_results = &results;
+			runRound(model, Task::Sentences);
+			m_batch = nullptr;
+			m_results = nullptr;
+
+			return results;
+		}
+
+		// Splits a long sentence into chunks of consecutive columns and
+		// decodes them in parallel along the time axis:
+		//  1. chunk 0 runs the forward pass, every other chunk computes its
+		//     max-plus transfer matrix: the best score from each label before
+		//     its first column to each label in its last one
+		//  2. the caller scans the chunks, multiplying (max-plus) the scores
+		//     before each chunk with its matrix to get those before the next
+		//  3. every chunk runs the forward pass from the scores before it and
+		//     follows its backpointers from each label in its last column to
+		//     the label before its first one
+		//  4. the caller picks the best last label and chains these maps
+		//     back to find the label that ends each chunk
+		//  5. every chunk backtraces its own part of the path
+		// Computing a transfer matrix costs labelCount forward passes.
+		std::vector<Label_type> inferChunked(
+			const Model& model, const std::vector<Emission_type>& ts) {
+			const int n = ts.size();
+			const int chunks =
+				std::min(ChunksPerThread * (m_spawn.threads() + 1),
+						 n / MinChunkColumns);
+			m_chunks.resize(chunks);
+			if (m_chunkScratch.size() < m_chunks.size() ||
+				m_chunkScratch.front().trellis.rows() !=
+					static_cast<size_t>(model.labelCount())) {
+				m_chunkScratch.assign(chunks, Scratch(model.labelCount()));
+			}
+			for (int c = 0; c < chunks; ++c) {
+				m_chunks[c].begin = (c * static_cast<long>(n)) / chunks;
+				m_chunks[c].end = ((c + 1) * static_cast<long>(n)) / chunks;
+			}
+			auto path = std::vector<Label_type>(n);
+			m_ts = ts.data();
+			m_path = &path;
+
+			runRound(model, Task::Transfers);
+
+			const int labelCount = model.labelCount();
+			auto before = std::vector<Probability_type>(labelCount);
+			const auto& first = m_chunkScratch.front().trellis;
+			for (int i = 0; i < labelCount; ++i) {
+				before[i] = first(i, m_chunks.front().end - 1);
+			}
+			for (int c = 1; c < chunks; ++c) {
+				auto& chunk = m_chunks[c];
+				chunk.before = before;
+				for (int i = 0; i < labelCount; ++i) {
+					auto best = -std::numeric_limits<Probability_type>::infinity();
+					for (int k = 0; k < labelCount; ++k) {
+						best = std::max(best, chunk.transfer[i * labelCount + k] +
+												  chunk.before[k]);
+					}
+					before[i] = best;
+				}
+			}
+
+			runRound(model, Task::Forward);
+
+			const auto& lastChunk = m_chunks.back();
+			const auto& last =
+				m_chunkScratch[chunks - 1].trellis;
+			const int lastColumn =
+				chunks == 1 ? lastChunk.end - 1 : lastChunk.end - lastChunk.begin;
+			m_chunks.back().last = std::distance(
+				&(last(0, lastColumn)),
+				std::max_element(&(last(0, lastColumn)),
+								 std::next(&(last(labelCount - 1, lastColumn)))));
+			for (int c = chunks - 1; c > 0; --c) {
+				m_chunks[c - 1].last = m_chunks[c].entry[m_chunks[c].last];
+			}
+
+			runRound(model, Task::Backtrace);
+			m_path = nullptr;
+
+			return path;
+		}
+
+	private:
+		// what the threads of a round work on
+		enum class Task { Sentences, Transfers, Forward, Backtrace, Prefixes };
+
+		// consecutive columns [begin, end) of a sentence given to inferChunked
+		struct Chunk {
+			int begin;
+			int end;
+			// max-plus transfer matrix, (to, from) row-major
+			std::vector<Probability_type> transfer;
+			// best scores of the labels before the first column
+			std::vector<Probability_type> before;
+			// label before the first column on the best path through each
+			// label in the last one
+			std::vector<Label_type> entry;
+			// label in the last column on the best path
+			Label_type last;
+		};
+
+		// the sentences of a batch merged by common prefixes. Every node is
+		// one distinct prefix and owns the trellis column of its last word;
+		// parents are created before their children.
+		struct Trie {
+			std::vector<int> parents;
+			std::vector<Emission_type> emissions;
+			// the subtree below each first word, nodes in creation order
+			std::vector<int> subtreeOf;
+			std::vector<std::vector<int>> subtrees;
+			// node of the last word of every sentence, -1 if it is empty
+			std::vector<int> ends;
+			// (parent + 1, emission) -> child
+			std::unordered_map<uint64_t, int> children;
+		};
+
+		// chunks are taken dynamically, more of them than threads even out
+		// the cheap chunk 0 and the uneven progress of the others
+		static const int ChunksPerThread = 4;
+		// below that the scan and the per-chunk setup cost more than they save
+		static const int MinChunkColumns = 64;
+
+		Context(const ModelPtr& current, const Strategy& strategy,
+				Placement placement, std::vector<ModelPtr> replicas)
+			: m_scratch(strategy.threads + 1, Scratch(current->labelCount())),
+			  m_current(current),
+			  m_model(nullptr),
+			  m_ts(nullptr),
+			  m_batch(nullptr),
+			  m_results(nullptr),
+			  m_nextItem(0),
+			  m_task(Task::Sentences),
+			  m_chunks(),
+			  m_chunkScratch(),
+			  m_path(nullptr),
+			  m_sharePrefixes(false),
+			  m_prefixStatistics(),
+			  m_trie(),
+			  m_trieScratch(),
+			  m_strategy(strategy),
+			  m_placement(placement),
+			  m_replicas(std::move(replicas)),
+			  m_spawn() {}
+
+		static short threadsFor(short childThreads) {
+			if (childThreads == options::AutoDetermineChildThreads) {
+				return std::max(1u, std::thread::hardware_concurrency()) - 1;
+			}
+			return std::max<short>(0, childThreads);
+		}
+
+		// times a synthetic sentence with 1, 2, 4, ... column workers (never
+		// more than there are label vectors) and keeps the fastest. More
+		// workers have to win by 10% so that noise never leaves us slower
+		// than the sequential SIMD loop.
+		Strategy calibrate(const Model& model) {
+			using clock = std::chrono::steady_clock;
+			const int columns = 33;
+			const int maxWorkers =
+				std::min<int>(m_strategy.threads + 1, model.labelVectorCount());
+
+			auto ts = std::vector<Emission_type>(columns);
+			for (int j = 0; j < columns; ++j) {
+				ts[j] = j % std::max(1, model.emissionCount());
+			}
+
+			const auto measure = [&]() {
+				auto best = std::numeric_limits<double>::infinity();
+				auto spent = 0.0;
+				for (int rep = 0; rep < 5 && spent < 0.02; ++rep) {
+					const auto before = clock::now();
+					infer(model, ts);
+					const auto t = std::chrono::duration<double>(
+									   clock::now() - before)
+									   .count();
+					best = std::min(best, t / (columns - 1));
+					spent += t;
+				}
+				return best;
+			};
+
+			auto candidates = std::vector<int>{};
+			for (int workers = 2; workers < maxWorkers; workers *= 2) {
+				candidates.push_back(workers);
+			}
+			if (maxWorkers > 1) {
+				candidates.push_back(maxWorkers);
+			}
+
+			auto strategy = m_strategy;
+			strategy.columnWorkers = 1;
+			strategy.sequentialColumn = measure();
+			strategy.parallelColumn = strategy.sequentialColumn;
+			for (auto workers : candidates) {
+				m_strategy.columnWorkers = workers;
+				m_spawn.spawn(*this, workers - 1, workers, m_placement);
+				const auto t = measure();
+				m_spawn.stop();
+				if (t < 0.9 * strategy.parallelColumn) {
+					strategy.columnWorkers = workers;
+					strategy.parallelColumn = t;
+				}
+			}
+			m_strategy.columnWorkers = 1;
+
+			return strategy;
+		}
+
+		// chunking costs labelCount + 1 forward passes over the sentence
+		// (see inferChunked), so it takes more threads than labels to win
+		// over the calibrated column strategy
+		bool timeParallel(const Model& model, int n) const {
+			const auto threads = m_spawn.threads() + 1.0;
+			if (threads < 2 || n < 2 * MinChunkColumns) return false;
+
+			const auto byChunks = n * (model.labelCount() + 1.0) *
+								  m_strategy.sequentialColumn / threads;
+			const auto byColumns = n * m_strategy.parallelColumn;
+			return byChunks < 0.9 * byColumns;
+		}
+
+		// one sentence per thread needs no barrier at all, so it wins as
+		// soon as the batch can keep every thread busy
+		bool sentenceParallel(
+			const std::vector<std::vector<Emission_type>>& batch) const {
+			if (m_spawn.threads() == 0 || batch.size() < 2) return false;
+
+			auto columns = size_t{0};
+			auto longest = size_t{0};
+			for (const auto& ts : batch) {
+				columns += ts.size();
+				longest = std::max(longest, ts.size());
+			}
+			const auto threads = m_spawn.threads() + 1.0;
+			const auto bySentence =
+				std::max(columns / threads, static_cast<double>(longest)) *
+				m_strategy.sequentialColumn;
+			const auto byColumn = columns * m_strategy.parallelColumn;
+			return bySentence < byColumn;
+		}
+
+		// one copy of the model per NUMA node, each made by a thread running
+		// on that node so that first touch puts its pages into local memory
+		static std::vector<ModelPtr> replicate(const ModelPtr& m,
+											   const Topology& topology) {
+			if (topology.nodes() < 2) {
+				return std::vector<ModelPtr>{};
+			}
+
+			auto replicas = std::vector<ModelPtr>(topology.nodes());
+			for (int node = 0; node < topology.nodes(); ++node) {
+				auto copier = std::thread{[&, node]() {
+					Topology::pinCurrent(topology.cpus(node).front());
+					replicas[node] = std::make_shared<const Model>(*m);
+				}};
+				copier.join();
+			}
+			return replicas;
+		}
+
+		inline int callerNode() const {
+			return m_replicas.empty() ? 0 : Topology::system().currentNode();
+		}
+
+		// the model workers on the given node read from
+		inline const Model& modelOn(int node) const {
+			return m_replicas.empty() ? *m_model : *m_replicas[node];
+		}
+
+		// the share of column worker `worker` in the current column
+		inline void computeColumn(const Model& model, const int worker) {
+			const auto j = m_spawn.m_column;
+			const auto r = m_spawn.range(worker, model.labelVectorCount());
+			VITERBI_PERF_SCOPE(Columns, labelsIn(model, r));
+			// by first label vector, to compare the shares of one column
+			VITERBI_TRACE_SPAN(Column, r.first);
+			Viterbi_type::computeColumn(model, m_scratch.front(), j, m_ts[j],
+										r.first, r.second);
+		}
+
+		// labels (not padding lanes) in a range of label vectors
+		static inline int labelsIn(const Model& model, std::pair<int, int> r) {
+			const int lanes = floatv::Size;
+			return std::max(
+				0, std::min(r.second * lanes, model.labelCount()) - r.first * lanes);
+		}
+
+		// runs a task on all threads and returns once all of them are done
+		inline void runRound(const Model& model, Task task) {
+			m_model = &model;
+			m_task = task;
+			m_nextItem.store(0, std::memory_order_relaxed);
+			m_spawn.startBatch();
+			runTask(modelOn(callerNode()), 0);
+			VITERBI_TRACE_SPAN(Barrier, -1);
+			m_spawn.await(m_spawn.threads());
+		}
+
+		// takes sentences off the current batch (or chunks off the current
+		// sentence) until none are left
+		inline void runTask(const Model& model, const int worker) {
+			const auto items =
+				m_task == Task::Sentences
+					? m_batch->size()
+					: m_task == Task::Prefixes ? m_trie.subtrees.size()
+											   : m_chunks.size();
+			for (auto i = m_nextItem.fetch_add(1); i < items;
+				 i = m_nextItem.fetch_add(1)) {
+				switch (m_task) {
+					case Task::Sentences:
+						(*m_results)[i] = decodeSequential(
+							model, m_scratch[worker], (*m_batch)[i]);
+						break;
+					case Task::Transfers:
+						chunkTransfer(model, i);
+						break;
+					case Task::Forward:
+						chunkForward(model, i);
+						break;
+					case Task::Backtrace:
+						chunkBacktrace(i);
+						break;
+					case Task::Prefixes:
+						computeSubtree(model, i);
+						break;
+				}
+			}
+		}
+
+		// decodes a batch as a trie of its sentences: the subtrees below
+		// different first words are independent and spread over the threads,
+		// within one every column follows the column of its parent
+		std::vector<std::vector<Label_type>> inferShared(
+			const Model& model,
+			const std::vector<std::vector<Emission_type>>& batch) {
+			buildTrie(model, batch);
+			const int nodes = m_trie.parents.size();
+			if (m_trieScratch.empty() ||
+				m_trieScratch.front().trellis.rows() !=
+					static_cast<size_t>(model.labelCount())) {
+				m_trieScratch.assign(1, Scratch(model.labelCount()));
+			}
+			auto& s = m_trieScratch.front();
+			// reserved up front, so threads writing their own columns never
+			// see the matrix move
+			s.reserve(std::max(nodes, 1));
+
+			if (m_spawn.threads() > 0 && m_trie.subtrees.size() > 1) {
+				runRound(model, Task::Prefixes);
+			} else {
+				for (size_t r = 0; r < m_trie.subtrees.size(); ++r) {
+					computeSubtree(model, r);
+				}
+			}
+
+			auto results = std::vector<std::vector<Label_type>>(batch.size());
+			auto naive = long{0};
+			for (size_t i = 0; i < batch.size(); ++i) {
+				results[i] = trieBacktrace(model, s, m_trie.ends[i],
+										   batch[i].size());
+				naive += batch[i].size();
+			}
+
+			auto& statistics = m_prefixStatistics;
+			statistics.sentences += batch.size();
+			statistics.columns += nodes;
+			statistics.naiveColumns += naive;
+			statistics.cellsSaved += (naive - nodes) * model.labelCount();
+			return results;
+		}
+
+		void buildTrie(const Model& model,
+					   const std::vector<std::vector<Emission_type>>& batch) {
+			auto& t = m_trie;
+			t.parents.clear();
+			t.emissions.clear();
+			t.subtreeOf.clear();
+			for (auto& subtree : t.subtrees) {
+				subtree.clear();
+			}
+			auto subtrees = size_t{0};
+			t.ends.assign(batch.size(), -1);
+			t.children.clear();
+
+			for (size_t i = 0; i < batch.size(); ++i) {
+				auto node = -1;
+				for (const auto word : batch[i]) {
+					// unknown words all decode like emission 0
+					const auto e = known(model, word);
+					const auto key = (static_cast<uint64_t>(node + 1) << 32) |
+									 static_cast<uint32_t>(e);
+					const auto found = t.children.find(key);
+					if (found != t.children.end()) {
+						node = found->second;
+						continue;
+					}
+
+					const int child = t.parents.size();
+					const auto subtree = node < 0 ? subtrees++ : t.subtreeOf[node];
+					if (t.subtrees.size() < subtrees) {
+						t.subtrees.emplace_back();
+					}
+					t.parents.push_back(node);
+					t.emissions.push_back(e);
+					t.subtreeOf.push_back(subtree);
+					t.subtrees[subtree].push_back(child);
+					t.children.emplace(key, child);
+					node = child;
+				}
+				t.ends[i] = node;
+			}
+			t.subtrees.resize(subtrees);
+		}
+
+		// the columns of all prefixes starting with the r-th distinct word
+		void computeSubtree(const Model& model, const size_t r) {
+			const auto& t = m_trie;
+			auto& s = m_trieScratch.front();
+			const int vectors = model.labelVectorCount();
+			VITERBI_PERF_SCOPE(Columns,
+							   t.subtrees[r].size() * model.labelCount());
+			VITERBI_TRACE_SPAN(Subtree, r);
+			for (const auto node : t.subtrees[r]) {
+				if (t.parents[node] < 0) {
+					firstColumn(model, s, t.emissions[node], node);
+				} else {
+					Viterbi_type::computeColumn(model, s, node, t.parents[node],
+												t.emissions[node], 0, vectors);
+				}
+			}
+		}
+
+		// the best path of the sentence of n words ending in node
+		std::vector<Label_type> trieBacktrace(const Model& model,
+											  const Scratch& s, int node,
+											  const int n) const {
+			if (n == 0) return std::vector<Label_type>{};
+			VITERBI_PERF_SCOPE(Backtrace, n);
+			VITERBI_TRACE_SPAN(Backtrace, n);
+			const int labelCount = model.labelCount();
+			const auto& trellis = s.trellis;
+
+			auto best = std::vector<Label_type>(n);
+			best[n - 1] = std::distance(
+				&(trellis(0, node)),
+				std::max_element(&(trellis(0, node)),
+								 std::next(&(trellis(labelCount - 1, node)))));
+			for (auto j = n - 1; j > 0; --j) {
+				best[j - 1] = s.backpointers(best[j], node);
+				node = m_trie.parents[node];
+			}
+			return best;
+		}
+
+		// step 1 of inferChunked
+		void chunkTransfer(const Model& model, const size_t c) {
+			VITERBI_TRACE_SPAN(Chunk, c);
+			const auto& chunk = m_chunks[c];
+			auto& s = m_chunkScratch[c];
+			const int labelCount = model.labelCount();
+			const int vectors = model.labelVectorCount();
+			if (c == 0) {
+				s.reserve(chunk.end);
+				firstColumn(model, s, m_ts[0]);
+				VITERBI_PERF_SCOPE(Columns, (chunk.end - 1) * labelCount);
+				for (int j = 1; j < chunk.end; ++j) {
+					Viterbi_type::computeColumn(model, s, j, m_ts[j], 0,
+												vectors);
+				}
+				return;
+			}
+
+			// one forward pass per label before the chunk, alternating
+			// between two columns of the chunk's trellis
+			VITERBI_PERF_SCOPE(
+				Columns, (chunk.end - chunk.begin) * labelCount * labelCount);
+			auto& transfer = m_chunks[c].transfer;
+			transfer.resize(labelCount * labelCount);
+			s.reserve(2);
+			for (int k = 0; k < labelCount; ++k) {
+				for (int i = 0; i < labelCount; ++i) {
+					s.trellis(i, 0) =
+						i == k ? 0
+							   : -std::numeric_limits<Probability_type>::infinity();
+				}
+				for (int j = chunk.begin; j < chunk.end; ++j) {
+					Viterbi_type::computeColumn(model, s, 1, m_ts[j], 0,
+												vectors);
+					for (int i = 0; i < vectors; ++i) {
+						s.trellis.vector(i, 0) = s.trellis.vector(i, 1);
+					}
+				}
+				for (int i = 0; i < labelCount; ++i) {
+					transfer[i * labelCount + k] = s.trellis(i, 0);
+				}
+			}
+		}
+
+		// step 3 of inferChunked: column 0 of the chunk's trellis holds the
+		// scores before it, column j its j-th column
+		void chunkForward(const Model& model, const size_t c) {
+			if (c == 0) return;
+			VITERBI_TRACE_SPAN(Chunk, c);
+			auto& chunk = m_chunks[c];
+			auto& s = m_chunkScratch[c];
+			const int labelCount = model.labelCount();
+			const auto columns = chunk.end - chunk.begin;
+
+			s.reserve(columns + 1);
+			for (int i = 0; i < labelCount; ++i) {
+				s.trellis(i, 0) = chunk.before[i];
+			}
+			{
+				VITERBI_PERF_SCOPE(Columns, columns * labelCount);
+				for (int j = 1; j <= columns; ++j) {
+					Viterbi_type::computeColumn(model, s, j,
+												m_ts[chunk.begin + j - 1], 0,
+												model.labelVectorCount());
+				}
+			}
+
+			chunk.entry.resize(labelCount);
+			for (int l = 0; l < labelCount; ++l) {
+				auto label = l;
+				for (int j = columns; j > 0; --j) {
+					label = s.backpointers(label, j);
+				}
+				chunk.entry[l] = label;
+			}
+		}
+
+		// step 5 of inferChunked
+		void chunkBacktrace(const size_t c) {
+			VITERBI_TRACE_SPAN(Backtrace, c);
+			const auto& chunk = m_chunks[c];
+			const auto& s = m_chunkScratch[c];
+			auto& path = *m_path;
+			// column of the chunk's trellis holding sentence column j
+			const auto offset = c == 0 ? 0 : 1 - chunk.begin;
+
+			path[chunk.end - 1] = chunk.last;
+			for (auto j = chunk.end - 1; j > chunk.begin; --j) {
+				path[j - 1] = s.backpointers(path[j], j + offset);
+			}
+		}
+
+	private:
+		// scratch 0 is used by the calling thread (and shared by all column
+		// workers), scratch i by thread i when decoding whole sentences
+		std::vector<Scratch> m_scratch;
+		// the model scratch and replicas are prepared for
+		ModelPtr m_current;
+		const Model* m_model;
+		const Emission_type* m_ts;
+		const std::vector<std::vector<Emission_type>>* m_batch;
+		std::vector<std::vector<Label_type>>* m_results;
+		std::atomic<size_t> m_nextItem;
+		Task m_task;
+		// inferChunked only
+		std::vector<Chunk> m_chunks;
+		std::vector<Scratch> m_chunkScratch;
+		std::vector<Label_type>* m_path;
+		// inferShared only
+		bool m_sharePrefixes;
+		PrefixStatistics m_prefixStatistics;
+		Trie m_trie;
+		std::vector<Scratch> m_trieScratch;
+		Strategy m_strategy;
+		Placement m_placement;
+		// per NUMA node, empty unless placement is NumaReplicated
+		std::vector<ModelPtr> m_replicas;
+		// declared last: the workers must be joined before anything they
+		// read is destroyed
+		WorkerSpawn m_spawn;
+	};  // end class Context
+
 private:
-	Model m_model;
-	Matrix_type trellis;
-	MatrixV<typename floatv::IndexType> backpointers;
-	int* m_tsStackPtr;
-	WorkerSpawn m_spawn;
+	ModelSlotPtr m_slot;
+	std::unique_ptr<Context> m_context;
 };  // end class Viterbi
 
 #endif
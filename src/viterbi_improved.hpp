@@ -7,6 +7,7 @@
 #include "utility.hpp"
 #include <iostream>
 #include <algorithm>
+#include <memory>
 #include <vector>
 #include <cmath>
 
@@ -43,26 +44,31 @@ public:
 
 	};  // end class Model
 
+	// a trained model is never modified again, so any number of decoders may
+	// read the same instance
+	using ModelPtr = std::shared_ptr<const Model>;
+
 public:
 	Viterbi() = delete;
-	Viterbi(const Model& m)
-		: m_model(m),
-		  trellis(m.start.size(), 8, std::log(0)),
-		  backpointers(m.start.size(), 8, 0) {}
-	Viterbi(Model&& m)
+	Viterbi(ModelPtr m)
 		: m_model(std::move(m)),
-		  trellis(m_model.start.size(), 8, std::log(0)),
-		  backpointers(m_model.start.size(), 8, 0) {}
+		  trellis(m_model->start.size(), 8, std::log(0)),
+		  backpointers(m_model->start.size(), 8, 0) {}
+	Viterbi(const Model& m) : Viterbi(std::make_shared<const Model>(m)) {}
+	Viterbi(Model&& m) : Viterbi(std::make_shared<const Model>(std::move(m))) {}
+
+	inline const ModelPtr& model() const { return m_model; }
 
-	std::vector<Label_type> infer(std::vector<Emission_type> ts) {
+	std::vector<Label_type> infer(const std::vector<Emission_type>& ts) {
 		const int n(ts.size());
-		const int labelCount(m_model.start.size());
+		const auto& model = *m_model;
+		const int labelCount(model.start.size());
 		trellis.reserve(labelCount * n);
 		backpointers.reserve(labelCount * n);
 
 		// first column
 		for (auto i = 0; i < labelCount; ++i) {
-			trellis(i, 0) = m_model.start[i] + m_model.emissions(i, ts[0]);
+			trellis(i, 0) = model.start[i] + model.emissions(i, ts[0]);
 		}
 
 		// other columns
@@ -74,8 +80,8 @@ public:
 				for (auto prev = 0; prev < labelCount; ++prev) {
 
 					auto candidate = trellis(prev, j - 1) +
-									 m_model.transitions(prev, i) +
-									 m_model.emissions(i, ts[j]);
+									 model.transitions(prev, i) +
+									 model.emissions(i, ts[j]);
 
 					winner = winnerProb < candidate ? prev : winner;
 					winnerProb =
@@ -118,8 +124,17 @@ public:
 		return best;
 	}  // end infer
 
+	std::vector<std::vector<Label_type>> inferBatch(
+		const std::vector<std::vector<Emission_type>>& batch) {
+		auto results = std::vector<std::vector<Label_type>>(batch.size());
+		for (size_t i = 0; i < batch.size(); ++i) {
+			results[i] = infer(batch[i]);
+		}
+		return results;
+	}
+
 private:
-	Model m_model;
+	ModelPtr m_model;
 	Matrix_type trellis;
 	Matrix<int> backpointers;
 };  // end class Viterbi
@@ -9,6 +9,7 @@
 
 #include <limits>
 #include <algorithm>
+#include <memory>
 #include <vector>
 
 template <typename probability_T, typename label_T = int,
@@ -63,33 +64,42 @@ public:
 		Matrix_type emissions;
 	};  // end class Model
 
+	// a trained model is never modified again, so any number of decoders may
+	// read the same instance
+	using ModelPtr = std::shared_ptr<const Model>;
+
 public:
 	Viterbi() = delete;
-	Viterbi(const Model& m)
-		: m_model(m),
-		  trellis(m.start.rows(), 8,
+	Viterbi(ModelPtr m)
+		: m_model(std::move(m)),
+		  trellis(m_model->start.rows(), 8,
 				  -(std::numeric_limits<Probability_type>::infinity())),
-		  backpointers(m.start.rows(), 8, 0) {}
+		  backpointers(m_model->start.rows(), 8, 0) {}
+	Viterbi(const Model& m) : Viterbi(std::make_shared<const Model>(m)) {}
+	Viterbi(Model&& m) : Viterbi(std::make_shared<const Model>(std::move(m))) {}
 
 	Viterbi(const Viterbi_type& other) = default;
 	Viterbi(Viterbi_type&& other) = default;
 	Viterbi_type& operator=(const Viterbi_type& rhs) = default;
 	Viterbi_type& operator=(Viterbi_type&& rhs) = default;
 
-	std::vector<Label_type> infer(std::vector<Emission_type> ts) {
+	inline const ModelPtr& model() const { return m_model; }
+
+	std::vector<Label_type> infer(const std::vector<Emission_type>& ts) {
 		const int n = ts.size();
 
 		if (n == 0) return std::vector<Label_type>{};
 
-		const int labelCount = m_model.start.rows();
-		const int labelVectorsCount = m_model.start.vectorsCountPerColumn();
+		const auto& model = *m_model;
+		const int labelCount = model.start.rows();
+		const int labelVectorsCount = model.start.vectorsCountPerColumn();
 		trellis.reserve(n);
 		backpointers.reserve(n);
 
 		// first column
 		for (auto i = 0; i < labelVectorsCount; ++i) {
-			const floatv s = m_model.start.vector(i, 0);
-			const floatv em = m_model.emissions.vector(i, ts[0]);
+			const floatv s = model.start.vector(i, 0);
+			const floatv em = model.emissions.vector(i, ts[0]);
 			trellis.vector(i, 0) = em + s;
 		}
 
@@ -99,11 +109,11 @@ public:
 				auto winnerProb = floatv(
 					-(std::numeric_limits<Probability_type>::infinity()));
 				auto winner = typename floatv::IndexType{0};
-				const auto emProb = floatv{m_model.emissions.vector(i, ts[j])};
+				const auto emProb = floatv{model.emissions.vector(i, ts[j])};
 
 				for (int prev = 0; prev < labelCount; ++prev) {
 					const auto p = trellis(prev, j - 1);
-					const auto t = floatv{m_model.transitions.vector(i, prev)};
+					const auto t = floatv{model.transitions.vector(i, prev)};
 					const auto candidate = p + t;
 					const auto mask = winnerProb < candidate;
 
@@ -131,8 +141,17 @@ public:
 		return best;
 	}  // end infer
 
+	std::vector<std::vector<Label_type>> inferBatch(
+		const std::vector<std::vector<Emission_type>>& batch) {
+		auto results = std::vector<std::vector<Label_type>>(batch.size());
+		for (size_t i = 0; i < batch.size(); ++i) {
+			results[i] = infer(batch[i]);
+		}
+		return results;
+	}
+
 private:
-	Model m_model;
+	ModelPtr m_model;
 	Matrix_type trellis;
 	MatrixV<typename floatv::IndexType> backpointers;
 };  // end class Viterbi
@@ -0,0 +1,547 @@
+#ifndef PARATERBI__VITERBI_TRIGRAM_HPP__
+#define PARATERBI__VITERBI_TRIGRAM_HPP__
+
+#include "viterbi.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <memory>
+#include <thread>
+#include <vector>
+
+// Second-order (trigram) decoder: the label of a word depends on the labels
+// of the two words before it.
+//
+// Instead of expanding the model to labels^2 composite states with a
+// labels^2 x labels^2 transition matrix, the trellis holds one column per
+// (previous, current) label pair, delta_j(u, v), and every column is
+//   delta_j(u, v) = max_w delta_{j-1}(w, u) + q(v | w, u) + e(x_j | v),
+// vectorized over v. The trigram tensor is stored as a matrix of labels
+// rows and one column per history (w, u), those sharing the middle label u
+// side by side: the histories of one pair column are one contiguous block
+// streamed through while the column being computed stays in L1 (blocked
+// max-plus). Histories scoring -inf are skipped, and since
+// delta_{j-1}(w, u) includes the emission of u, a column only costs
+// O(labels / Size) per pair of labels the two previous words can have.
+//
+// With pruning, label pairs the training corpus never saw next to each
+// other are impossible from the third word on, which also keeps unknown
+// words (emitted by many labels) from widening every following column.
+// The first two words are scored by the start and bigram probabilities.
+//
+// inferBatch decodes one sentence per thread, on threads started once.
+template <typename probability_T, typename options = DefaultOptions>
+class TrigramViterbi {
+public:
+	using Label_type = typename options::Label_type;
+	using Emission_type = typename options::Emission_type;
+	using Probability_type = probability_T;
+	using floatv = Vc::Vector<Probability_type>;
+	using Matrix_type = MatrixV<floatv>;
+	using Viterbi_type = TrigramViterbi<Probability_type, options>;
+
+	struct Model {
+	public:
+		using Label_type = Viterbi_type::Label_type;
+		using Emission_type = Viterbi_type::Emission_type;
+		using Probability_type = Viterbi_type::Probability_type;
+		using Matrix_type = Viterbi_type::Matrix_type;
+
+		friend Viterbi_type;
+
+	public:
+		Model() = delete;
+		Model(int labels, int emissions, Probability_type defaultValue)
+			: start(labels, 1, defaultValue),
+			  transitions(labels, labels, defaultValue),
+			  trigrams(labels, labels * labels, defaultValue),
+			  pairs(labels, labels,
+					-std::numeric_limits<Probability_type>::infinity()),
+			  emissions(labels, emissions, defaultValue) {}
+
+		Model(const Model& other) = default;
+		Model(Model&& other) = default;
+		Model& operator=(const Model& rhs) = default;
+		Model& operator=(Model&& rhs) = default;
+
+	public:
+		inline void setStart(Label_type i, Probability_type value) {
+			start(i, 0) = value;
+		}
+
+		// bigram probabilities, for the second word and to tell seen label
+		// pairs (those with a finite probability) from unseen ones
+		inline void setTransition(Label_type from, Label_type to,
+								  Probability_type value) {
+			transitions(to, from) = value;
+			pairs(to, from) =
+				value > -std::numeric_limits<Probability_type>::infinity()
+					? 0
+					: -std::numeric_limits<Probability_type>::infinity();
+		}
+
+		// probability of `to` following `first` and `second`
+		inline void setTrigram(Label_type first, Label_type second,
+							   Label_type to, Probability_type value) {
+			trigrams(to, history(first, second)) = value;
+		}
+
+		inline void setEmission(Label_type label, Emission_type emission,
+								Probability_type value) {
+			emissions(label, emission) = value;
+		}
+
+		inline Probability_type getStart(Label_type i) const {
+			return start(i, 0);
+		}
+
+		inline Probability_type getTransition(Label_type from,
+											  Label_type to) const {
+			return transitions(to, from);
+		}
+
+		inline Probability_type getTrigram(Label_type first, Label_type second,
+										   Label_type to) const {
+			return trigrams(to, history(first, second));
+		}
+
+		inline Probability_type getEmission(Label_type label,
+											Emission_type emission) const {
+			return emissions(label, emission);
+		}
+
+		inline int labelCount() const { return start.rows(); }
+		inline int labelVectorCount() const {
+			return start.vectorsCountPerColumn();
+		}
+		inline int emissionCount() const { return emissions.columns(); }
+
+	private:
+		// column of trigrams, histories with the same second label adjacent
+		inline int history(Label_type first, Label_type second) const {
+			return second * labelCount() + first;
+		}
+
+	private:
+		Matrix_type start;
+		// (to, from)
+		Matrix_type transitions;
+		// (to, history(first, second))
+		Matrix_type trigrams;
+		// (to, from): 0 for label pairs seen in training, -inf otherwise
+		Matrix_type pairs;
+		Matrix_type emissions;
+	};  // end class Model
+
+	using ModelPtr = std::shared_ptr<const Model>;
+
+	// like Viterbi::ModelSlot: updates swap the pointer, decoding keeps the
+	// model it started with
+	class ModelSlot {
+	public:
+		explicit ModelSlot(ModelPtr m) : m_model(std::move(m)) {}
+
+		ModelSlot(const ModelSlot& other) = delete;
+		ModelSlot& operator=(const ModelSlot& rhs) = delete;
+
+		inline ModelPtr load() const { return std::atomic_load(&m_model); }
+		inline void publish(ModelPtr m) {
+			std::atomic_store(&m_model, std::move(m));
+		}
+
+	private:
+		ModelPtr m_model;
+	};  // end class ModelSlot
+
+	using ModelSlotPtr = std::shared_ptr<ModelSlot>;
+
+public:
+	// constructors
+	TrigramViterbi() = delete;
+	TrigramViterbi(ModelSlotPtr slot,
+				   short childThreads = options::AutoDetermineChildThreads,
+				   Placement placement = Placement::Unpinned)
+		: m_slot(std::move(slot)),
+		  m_prune(false),
+		  m_workers(std::make_unique<Workers>(threadsFor(childThreads),
+											  placement)) {}
+
+	TrigramViterbi(ModelPtr m,
+				   short childThreads = options::AutoDetermineChildThreads,
+				   Placement placement = Placement::Unpinned)
+		: TrigramViterbi(std::make_shared<ModelSlot>(std::move(m)),
+						 childThreads, placement) {}
+
+	TrigramViterbi(const Model& m,
+				   short childThreads = options::AutoDetermineChildThreads,
+				   Placement placement = Placement::Unpinned)
+		: TrigramViterbi(std::make_shared<const Model>(m), childThreads,
+						 placement) {}
+
+	TrigramViterbi(Model&& m,
+				   short childThreads = options::AutoDetermineChildThreads,
+				   Placement placement = Placement::Unpinned)
+		: TrigramViterbi(std::make_shared<const Model>(std::move(m)),
+						 childThreads, placement) {}
+
+	// a copy shares the model slot, but gets its own trellises and threads
+	TrigramViterbi(const Viterbi_type& other)
+		: m_slot(other.m_slot),
+		  m_prune(other.m_prune),
+		  m_workers(std::make_unique<Workers>(other.m_workers->threads(),
+											  other.m_workers->placement())) {}
+
+	TrigramViterbi(Viterbi_type&& other) noexcept = default;
+
+	Viterbi_type& operator=(const Viterbi_type& rhs) {
+		if (this != &rhs) {
+			*this = Viterbi_type{rhs};
+		}
+		return *this;
+	}
+
+	Viterbi_type& operator=(Viterbi_type&& rhs) noexcept = default;
+
+	~TrigramViterbi() = default;
+
+	inline ModelPtr model() const { return m_slot->load(); }
+	inline const ModelSlotPtr& slot() const { return m_slot; }
+	inline int labelCount() const { return model()->labelCount(); }
+	inline int labelVectorCount() const { return model()->labelVectorCount(); }
+
+	inline void publish(ModelPtr m) { m_slot->publish(std::move(m)); }
+
+	// rules out label pairs never seen in training from the third word on
+	inline void setPruning(bool prune) { m_prune = prune; }
+	inline bool pruning() const { return m_prune; }
+
+	std::vector<Label_type> infer(const std::vector<Emission_type>& ts) {
+		const auto m = m_slot->load();
+		return decode(*m, m_workers->scratch(0), ts, m_prune);
+	}
+
+	std::vector<std::vector<Label_type>> inferBatch(
+		const std::vector<std::vector<Emission_type>>& batch) {
+		const auto m = m_slot->load();
+		auto results = std::vector<std::vector<Label_type>>(batch.size());
+		if (m_workers->threads() == 0 || batch.size() < 2) {
+			for (size_t i = 0; i < batch.size(); ++i) {
+				results[i] =
+					decode(*m, m_workers->scratch(0), batch[i], m_prune);
+			}
+			return results;
+		}
+		m_workers->run(*m, batch, results, m_prune);
+		return results;
+	}
+
+private:
+	using IndexMatrix_type = MatrixV<typename floatv::IndexType>;
+
+	// trellis and backpointers of a single sentence: column j * labels + u
+	// holds delta_j(u, v) over v, column 0 the scores of the first word.
+	// Labels still alive in the previous column (firsts: as the first label
+	// of a pair, seconds: as the second one) are kept as lists.
+	struct Scratch {
+		Scratch()
+			: trellis(1, 8,
+					  -(std::numeric_limits<Probability_type>::infinity())),
+			  backpointers(1, 8, 0) {}
+
+		inline void reserve(int labels, int n) {
+			if (static_cast<int>(alive.size()) != labels) {
+				trellis = Matrix_type{
+					labels, n * labels,
+					-(std::numeric_limits<Probability_type>::infinity())};
+				backpointers = IndexMatrix_type{labels, n * labels, 0};
+				alive.assign(labels, false);
+			}
+			trellis.reserve(n * labels);
+			backpointers.reserve(n * labels);
+		}
+
+		Matrix_type trellis;
+		IndexMatrix_type backpointers;
+		std::vector<Label_type> firsts;
+		std::vector<Label_type> seconds;
+		std::vector<Label_type> nextFirsts;
+		std::vector<bool> alive;
+	};
+
+	static short threadsFor(short childThreads) {
+		if (childThreads == options::AutoDetermineChildThreads) {
+			return std::max(1u, std::thread::hardware_concurrency()) - 1;
+		}
+		return std::max<short>(0, childThreads);
+	}
+
+	static inline Emission_type known(const Model& model, Emission_type e) {
+		return e < model.emissionCount() ? e : 0;
+	}
+
+	static inline bool possible(Probability_type p) {
+		return p > -std::numeric_limits<Probability_type>::infinity();
+	}
+
+	// the labels v with a finite delta_j(u, v) for some u in s.nextFirsts
+	// become s.seconds, s.nextFirsts becomes s.firsts
+	static void collect(const Model& model, Scratch& s, const int j) {
+		const int labelCount = model.labelCount();
+		std::fill(s.alive.begin(), s.alive.end(), false);
+		for (const auto u : s.nextFirsts) {
+			for (int v = 0; v < labelCount; ++v) {
+				if (possible(s.trellis(v, j * labelCount + u))) {
+					s.alive[v] = true;
+				}
+			}
+		}
+		s.seconds.clear();
+		for (Label_type v = 0; v < labelCount; ++v) {
+			if (s.alive[v]) s.seconds.push_back(v);
+		}
+		std::swap(s.firsts, s.nextFirsts);
+	}
+
+	static inline void firstColumn(const Model& model, Scratch& s,
+								   Emission_type e) {
+		e = known(model, e);
+		for (auto i = 0; i < model.labelVectorCount(); ++i) {
+			const floatv st = model.start.vector(i, 0);
+			const floatv em = model.emissions.vector(i, e);
+			s.trellis.vector(i, 0) = em + st;
+		}
+	}
+
+	// delta_1(u, v) = delta_0(u) + t(v | u) + e(x_1 | v)
+	static inline void secondColumn(const Model& model, Scratch& s,
+									Emission_type e) {
+		const int labelCount = model.labelCount();
+		e = known(model, e);
+		s.nextFirsts.clear();
+		for (Label_type u = 0; u < labelCount; ++u) {
+			const auto p = s.trellis(u, 0);
+			if (!possible(p)) continue;
+			const auto column = labelCount + u;
+			for (int i = 0; i < model.labelVectorCount(); ++i) {
+				const auto t = floatv{model.transitions.vector(i, u)};
+				const auto em = floatv{model.emissions.vector(i, e)};
+				s.trellis.vector(i, column) = floatv(p) + t + em;
+			}
+			s.nextFirsts.push_back(u);
+		}
+		collect(model, s, 1);
+	}
+
+	// the pair columns of column j >= 2, for every middle label u alive in
+	// column j - 1
+	static inline void computeColumn(const Model& model, Scratch& s,
+									 const int j, Emission_type e,
+									 const bool prune) {
+		using IndexType = typename floatv::IndexType;
+		const int labelCount = model.labelCount();
+		const int vectors = model.labelVectorCount();
+		e = known(model, e);
+		auto& trellis = s.trellis;
+		const int previous = (j - 1) * labelCount;
+
+		s.nextFirsts.clear();
+		for (const auto u : s.seconds) {
+			const int column = j * labelCount + u;
+			for (int i = 0; i < vectors; ++i) {
+				trellis.vector(i, column) =
+					floatv(-(std::numeric_limits<Probability_type>::infinity()));
+				s.backpointers.vector(i, column) = IndexType{0};
+			}
+			for (const auto w : s.firsts) {
+				const auto p = trellis(u, previous + w);
+				if (!possible(p)) continue;
+				const auto pv = floatv(p);
+				const auto wv = IndexType(w);
+				const int h = model.history(w, u);
+				for (int i = 0; i < vectors; ++i) {
+					const auto candidate =
+						pv + floatv{model.trigrams.vector(i, h)};
+					auto& winnerProb = trellis.vector(i, column);
+					auto& winner = s.backpointers.vector(i, column);
+					const auto mask = winnerProb < candidate;
+
+					winner = Vc::iif(mask, wv, IndexType{winner});
+					winnerProb = Vc::iif(mask, candidate, floatv{winnerProb});
+				}
+			}
+			for (int i = 0; i < vectors; ++i) {
+				auto score = floatv{trellis.vector(i, column)} +
+							 floatv{model.emissions.vector(i, e)};
+				if (prune) score += floatv{model.pairs.vector(i, u)};
+				trellis.vector(i, column) = score;
+			}
+			s.nextFirsts.push_back(u);
+		}
+		collect(model, s, j);
+	}
+
+	static inline std::vector<Label_type> backtrace(const Model& model,
+													const Scratch& s,
+													const int n) {
+		const int labelCount = model.labelCount();
+		const auto& trellis = s.trellis;
+		auto best = std::vector<Label_type>(n, 0);
+		if (n == 1) {
+			best[0] = std::distance(
+				&(trellis(0, 0)),
+				std::max_element(&(trellis(0, 0)),
+								 std::next(&(trellis(labelCount - 1, 0)))));
+			return best;
+		}
+
+		// best pair of the last column; all 0 if every path is impossible,
+		// whose pair columns were never written
+		auto bestProb = -std::numeric_limits<Probability_type>::infinity();
+		const int last = (n - 1) * labelCount;
+		for (const auto u : s.firsts) {
+			for (Label_type v = 0; v < labelCount; ++v) {
+				if (bestProb < trellis(v, last + u)) {
+					bestProb = trellis(v, last + u);
+					best[n - 2] = u;
+					best[n - 1] = v;
+				}
+			}
+		}
+		if (!possible(bestProb)) return best;
+
+		for (auto j = n - 1; j > 1; --j) {
+			best[j - 2] = s.backpointers(best[j], j * labelCount + best[j - 1]);
+		}
+		return best;
+	}
+
+	static std::vector<Label_type> decode(const Model& model, Scratch& s,
+										  const std::vector<Emission_type>& ts,
+										  const bool prune) {
+		const int n = ts.size();
+		if (n == 0) return std::vector<Label_type>{};
+		VITERBI_TRACE_SPAN(Sentence, n);
+
+		s.reserve(model.labelCount(), n);
+		firstColumn(model, s, ts[0]);
+		if (n > 1) {
+			secondColumn(model, s, ts[1]);
+		}
+		for (int j = 2; j < n; ++j) {
+			computeColumn(model, s, j, ts[j], prune);
+		}
+		return backtrace(model, s, n);
+	}
+
+	// threads decoding the sentences of a batch, one at a time each, started
+	// once like Viterbi's workers. Lives on the heap so that its address
+	// (which the threads hold on to) survives moving the owning decoder.
+	class Workers {
+	public:
+		Workers(short threads, Placement placement)
+			: m_round(0),
+			  m_done(0),
+			  m_next(0),
+			  m_stop(false),
+			  m_placement(placement),
+			  m_scratch(threads + 1) {
+			const auto& topology = Topology::system();
+			const bool pinned = placement != Placement::Unpinned;
+			m_threads.reserve(threads);
+			for (int i = 1; i <= threads; ++i) {
+				m_threads.emplace_back(Workers::worker, std::ref(*this), i);
+				const auto cpu = topology.cpuForWorker(i);
+				if (pinned && !Topology::pin(m_threads.back(), cpu)) {
+					std::cerr << "Could not pin worker " << i << " to cpu "
+							  << cpu << ".\n";
+				}
+			}
+		}
+
+		Workers(const Workers& other) = delete;
+		Workers& operator=(const Workers& rhs) = delete;
+
+		~Workers() {
+			m_stop.store(true, std::memory_order_release);
+			for (auto& t : m_threads) {
+				t.join();
+			}
+		}
+
+		inline short threads() const { return m_threads.size(); }
+		inline Placement placement() const { return m_placement; }
+		inline Scratch& scratch(int thread) { return m_scratch[thread]; }
+
+		// decodes the batch on all threads and returns once all are done
+		void run(const Model& model,
+				 const std::vector<std::vector<Emission_type>>& batch,
+				 std::vector<std::vector<Label_type>>& results, bool prune) {
+			m_model = &model;
+			m_batch = &batch;
+			m_results = &results;
+			m_prune = prune;
+			m_next.store(0, std::memory_order_relaxed);
+			m_done.store(0, std::memory_order_relaxed);
+			m_round.fetch_add(1, std::memory_order_release);
+			work(0);
+			VITERBI_TRACE_SPAN(Barrier, -1);
+			spinUntil([&]() {
+				return m_done.load(std::memory_order_acquire) == threads();
+			});
+		}
+
+	private:
+		static void worker(Workers& workers, const int index) {
+			auto seen = int{0};
+			while (true) {
+				auto round = seen;
+				{
+					VITERBI_TRACE_SPAN(Wait, index);
+					spinUntil([&]() {
+						round = workers.m_round.load(std::memory_order_acquire);
+						return round != seen ||
+							   workers.m_stop.load(std::memory_order_relaxed);
+					});
+				}
+				if (workers.m_stop.load(std::memory_order_acquire)) {
+					return;
+				}
+				seen = round;
+				workers.work(index);
+				workers.m_done.fetch_add(1, std::memory_order_release);
+			}
+		}
+
+		inline void work(const int index) {
+			const auto& batch = *m_batch;
+			for (auto i = m_next.fetch_add(1); i < batch.size();
+				 i = m_next.fetch_add(1)) {
+				(*m_results)[i] =
+					decode(*m_model, m_scratch[index], batch[i], m_prune);
+			}
+		}
+
+	private:
+		std::atomic<int> m_round;
+		std::atomic<int> m_done;
+		std::atomic<size_t> m_next;
+		std::atomic<bool> m_stop;
+		const Placement m_placement;
+		// scratch i belongs to thread i, 0 to the caller
+		std::vector<Scratch> m_scratch;
+		std::vector<std::thread> m_threads;
+		// the round in progress
+		const Model* m_model = nullptr;
+		const std::vector<std::vector<Emission_type>>* m_batch = nullptr;
+		std::vector<std::vector<Label_type>>* m_results = nullptr;
+		bool m_prune = false;
+	};  // end class Workers
+
+private:
+	ModelSlotPtr m_slot;
+	bool m_prune;
+	std::unique_ptr<Workers> m_workers;
+};  // end class TrigramViterbi
+
+#endif
@@ -0,0 +1,73 @@
+
+
+#include "viterbi.hpp"
+#include "HMM.hpp"
+
+#include <fstream>
+#include <iostream>
+#include <string>
+
+// Writes the word and label ids of a model as "id\tname" lines, for clients
+// of paraterbi --binary that map their tokens to ids themselves. Words
+// missing from the table may be sent as any id beyond it, paraterbi reads
+// them as 0 like the unknown words of text input.
+
+using Hmm_type = HMM<Viterbi<double>>;
+
+struct Arguments {
+	std::string corpus = "../data/corpus.txt";
+	std::string model;
+	std::string words = "words.tsv";
+	std::string labels = "labels.tsv";
+};
+
+bool parseArguments(int argc, char** argv, Arguments& args) {
+	for (int i = 1; i < argc; ++i) {
+		const auto arg = std::string{argv[i]};
+		if (arg == "--corpus" && i + 1 < argc) {
+			args.corpus = argv[++i];
+		} else if (arg == "--model" && i + 1 < argc) {
+			args.model = argv[++i];
+		} else if (arg == "--words" && i + 1 < argc) {
+			args.words = argv[++i];
+		} else if (arg == "--labels" && i + 1 < argc) {
+			args.labels = argv[++i];
+		} else {
+			std::cerr << "usage: " << argv[0]
+					  << " [--corpus FILE | --model FILE] [--words FILE]"
+						 " [--labels FILE]\n";
+			return false;
+		}
+	}
+	return true;
+}
+
+int main(int argc, char** argv) {
+	auto args = Arguments{};
+	if (!parseArguments(argc, argv, args)) {
+		return 1;
+	}
+
+	try {
+		auto saved = std::ifstream{args.model};
+		// decodes nothing, only holds the vocabulary
+		const auto hmm = args.model.empty() ? Hmm_type{args.corpus, short{0}}
+											: Hmm_type{saved, short{0}};
+
+		auto words = std::ofstream{args.words};
+		auto labels = std::ofstream{args.labels};
+		hmm.exportIds(words, labels);
+		if (!words || !labels) {
+			std::cerr << "Could not write " << args.words << " and "
+					  << args.labels << "\n";
+			return 1;
+		}
+		std::cerr << hmm.emissionCount() << " words, " << hmm.labelCount()
+				  << " labels\n";
+	} catch (const std::exception& e) {
+		std::cerr << e.what() << "\n";
+		return 1;
+	}
+
+	return 0;
+}